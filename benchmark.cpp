@@ -0,0 +1,205 @@
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include "delimiter_scan.h"
+#include "executor.h"
+#include "row_store.h"
+#include "table_io.h"
+
+namespace {
+const int repeats = 20;
+
+// Runs the function several times after the untimed setup and prints the
+// best time and throughput.
+void Measure(const std::string& name, size_t bytes, const std::function<size_t()>& function,
+             const std::function<void()>& setup = [] {}) {
+    double best = 1e100;
+    size_t checksum = 0;
+    for (int i = 0; i < repeats; ++i) {
+        setup();
+        auto start = std::chrono::steady_clock::now();
+        checksum = function();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    std::cout << name << ": " << best * 1000 << " ms, " << bytes / best / (1 << 20) << " MiB/s"
+              << " (checksum " << checksum << ")\n";
+}
+
+// Compares the getline based row parsing with the mapped reader and the raw
+// delimiter scanner with memchr.
+void BenchmarkScan(const std::string& table_path) {
+    MappedFile file;
+    if (!file.Open(table_path)) {
+        throw std::runtime_error("Can't map " + table_path);
+    }
+    std::string_view data = file.GetData();
+    std::cout << "scan " << table_path << ", " << data.size() << " bytes, "
+              << GetDelimiterScanName() << " scanner\n";
+
+    Measure("getline rows", data.size(), [&table_path] {
+        std::ifstream stream(table_path);
+        std::string key, value;
+        size_t total = 0;
+        while (std::getline(stream, key, '\t') && std::getline(stream, value)) {
+            total += key.size() + value.size();
+        }
+        return total;
+    });
+    Measure("mapped reader rows", data.size(), [&table_path] {
+        size_t total = 0;
+        for (TableReader reader(table_path); !reader.Empty(); reader.Next()) {
+            total += reader.GetKeyView().size() + reader.GetValueView().size();
+        }
+        return total;
+    });
+    Measure("memchr newlines", data.size(), [data] {
+        size_t count = 0;
+        const char* end = data.data() + data.size();
+        for (const char* it = data.data(); it != end; ++count) {
+            auto found = static_cast<const char*>(std::memchr(it, '\n', end - it));
+            it = found ? found + 1 : end;
+        }
+        return count;
+    });
+    Measure("FindByte newlines", data.size(), [data] {
+        size_t count = 0;
+        const char* end = data.data() + data.size();
+        for (const char* it = data.data(); it != end; ++count) {
+            const char* found = FindByte(it, end, '\n');
+            it = found == end ? end : found + 1;
+        }
+        return count;
+    });
+}
+
+// Compares the old sort of TableItem pairs with the RowStore sorts, e.g. on
+// the word count map output.
+void BenchmarkSort(const std::string& table_path) {
+    RowStore source;
+    {
+        TableReader reader(table_path);
+        source.Append(reader);
+    }
+    size_t bytes = source.GetMemoryUsage();
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    std::cout << "sort " << table_path << ", " << source.Size() << " rows\n";
+
+    std::vector<TableItem> items;
+    Measure("TableItem pairs std::sort", bytes, [&items] {
+        std::sort(items.begin(), items.end());
+        return items.size();
+    }, [&table_path, &items] {
+        items = TableReader(table_path).ReadAllItems();
+    });
+
+    RowStore rows;
+    auto reset = [&rows, &source] {
+        rows = source;
+    };
+    auto checksum = [&rows] {
+        auto& sorted = rows.GetRows();
+        return static_cast<size_t>(sorted.front().offset ^ sorted.back().offset);
+    };
+    Measure("row store comparison sort", bytes, [&] {
+        rows.ComparisonSort();
+        return checksum();
+    }, reset);
+    Measure("radix sort, key and value", bytes, [&] {
+        rows.Sort(SortOrder::KeyValue);
+        return checksum();
+    }, reset);
+    Measure("radix sort, key", bytes, [&] {
+        rows.Sort(SortOrder::Key);
+        return checksum();
+    }, reset);
+    Measure("radix sort, stable key", bytes, [&] {
+        rows.Sort(SortOrder::StableKey);
+        return checksum();
+    }, reset);
+    Measure("radix sort, key, " + std::to_string(threads) + " threads", bytes, [&] {
+        rows.Sort(SortOrder::Key, threads);
+        return checksum();
+    }, reset);
+}
+
+// Times from the first submit to the completion of the last task, once per
+// scheduling policy, for a chain of trivial tasks each depending on the
+// previous one and for a fan-in of trivial tasks awaited by a single one.
+void BenchmarkTasks(size_t count) {
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    std::cout << "tasks, " << count << " per job, " << threads << " threads\n";
+    auto measure = [count](const std::string& name, const std::function<size_t()>& function) {
+        auto start = std::chrono::steady_clock::now();
+        size_t checksum = function();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << name << ": " << elapsed.count() * 1000 << " ms, " << elapsed.count() * 1e9 / count
+                  << " ns per task (checksum " << checksum << ")\n";
+    };
+    for (auto policy : {SchedulingPolicy::Fifo, SchedulingPolicy::WorkStealing, SchedulingPolicy::Priority}) {
+        std::string name = policy == SchedulingPolicy::Fifo ? "fifo"
+                         : policy == SchedulingPolicy::WorkStealing ? "work stealing" : "priority";
+        auto executor = MakeThreadPoolExecutor(threads, policy);
+        std::atomic<size_t> done{0};
+        auto increment = [&done] {
+            ++done;
+            return Unit{};
+        };
+        // Tasks don't capture each other, so the chain is released without recursion.
+        measure(name + " chain", [&] {
+            done = 0;
+            FuturePtr<Unit> last = executor->invoke<Unit>(increment);
+            for (size_t i = 1; i < count; ++i) {
+                last = executor->then<Unit>(last, increment);
+            }
+            last->get();
+            return done.load();
+        });
+        measure(name + " inline chain", [&] {
+            done = 0;
+            FuturePtr<Unit> last = executor->invoke<Unit>(increment);
+            for (size_t i = 1; i < count; ++i) {
+                last = executor->then<Unit>(last, increment, true);
+            }
+            last->get();
+            return done.load();
+        });
+        measure(name + " fan-in", [&] {
+            done = 0;
+            std::vector<FuturePtr<Unit>> all;
+            all.reserve(count);
+            for (size_t i = 0; i < count; ++i) {
+                all.push_back(executor->invoke<Unit>(increment));
+            }
+            executor->whenAll(std::move(all))->get();
+            return done.load();
+        });
+        executor->startShutdown();
+        executor->waitShutdown();
+    }
+}
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2 || (argc < 3 && std::string(argv[1]) != "tasks")) {
+        std::cerr << "Usage: " << argv[0] << " scan|sort <table>\n"
+                  << "       " << argv[0] << " tasks [count]\n";
+        return 1;
+    }
+    std::string mode = argv[1];
+    if (mode == "tasks") {
+        BenchmarkTasks(argc > 2 ? std::stoul(argv[2]) : 1'000'000);
+    } else if (mode == "scan") {
+        BenchmarkScan(argv[2]);
+    } else if (mode == "sort") {
+        BenchmarkSort(argv[2]);
+    } else {
+        std::cerr << "Unknown benchmark " << mode << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,25 @@
+from os import environ
+from sys import stdin
+from typing import Iterator, List
+
+# Persistent workers get MAPREDUCE_PERSISTENT in their environment and read
+# any number of chunks, each ending with a line holding only CHUNK_END. The
+# line has to be echoed once the output of the chunk is printed.
+CHUNK_END = '\x1e'
+
+
+def read_chunks() -> Iterator[List[str]]:
+    """Yields the rows of every input chunk; outside a persistent worker the
+    whole input is one chunk. The end of a chunk is echoed when the caller
+    asks for the next one, i.e. after it printed the chunk's output."""
+    persistent = 'MAPREDUCE_PERSISTENT' in environ
+    rows: List[str] = []
+    for row in stdin:
+        if persistent and row.rstrip('\n') == CHUNK_END:
+            yield rows
+            print(CHUNK_END, flush=True)
+            rows = []
+        else:
+            rows.append(row)
+    if rows or not persistent:
+        yield rows
@@ -0,0 +1,95 @@
+#include "delimiter_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DELIMITER_SCAN_X86
+#endif
+
+namespace {
+const char* FindEitherScalar(const char* begin, const char* end, char first, char second) {
+    for (; begin != end; ++begin) {
+        if (*begin == first || *begin == second) {
+            return begin;
+        }
+    }
+    return end;
+}
+
+#ifdef DELIMITER_SCAN_X86
+__attribute__((target("sse2")))
+const char* FindEitherSse2(const char* begin, const char* end, char first, char second) {
+    const __m128i first_mask = _mm_set1_epi8(first);
+    const __m128i second_mask = _mm_set1_epi8(second);
+    for (; end - begin >= 16; begin += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+        int matches = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, first_mask),
+                                                     _mm_cmpeq_epi8(chunk, second_mask)));
+        if (matches != 0) {
+            return begin + __builtin_ctz(matches);
+        }
+    }
+    return FindEitherScalar(begin, end, first, second);
+}
+
+__attribute__((target("avx2"), always_inline)) inline
+__m256i MatchesAvx2(const char* position, __m256i first_mask, __m256i second_mask) {
+    __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(position));
+    return _mm256_or_si256(_mm256_cmpeq_epi8(chunk, first_mask), _mm256_cmpeq_epi8(chunk, second_mask));
+}
+
+__attribute__((target("avx2")))
+const char* FindEitherAvx2(const char* begin, const char* end, char first, char second) {
+    const __m256i first_mask = _mm256_set1_epi8(first);
+    const __m256i second_mask = _mm256_set1_epi8(second);
+    // Long values are common, so test 128 bytes per iteration before locating the match.
+    for (; end - begin >= 128; begin += 128) {
+        __m256i any = _mm256_or_si256(
+            _mm256_or_si256(MatchesAvx2(begin, first_mask, second_mask),
+                            MatchesAvx2(begin + 32, first_mask, second_mask)),
+            _mm256_or_si256(MatchesAvx2(begin + 64, first_mask, second_mask),
+                            MatchesAvx2(begin + 96, first_mask, second_mask)));
+        if (!_mm256_testz_si256(any, any)) {
+            break;
+        }
+    }
+    for (; end - begin >= 32; begin += 32) {
+        int matches = _mm256_movemask_epi8(MatchesAvx2(begin, first_mask, second_mask));
+        if (matches != 0) {
+            return begin + __builtin_ctz(matches);
+        }
+    }
+    return FindEitherSse2(begin, end, first, second);
+}
+#endif
+
+struct ScanImplementation {
+    const char* (*find_either)(const char*, const char*, char, char);
+    const char* name;
+};
+
+ScanImplementation ChooseImplementation() {
+#ifdef DELIMITER_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return {FindEitherAvx2, "avx2"};
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return {FindEitherSse2, "sse2"};
+    }
+#endif
+    return {FindEitherScalar, "scalar"};
+}
+
+const ScanImplementation& GetImplementation() {
+    static const ScanImplementation implementation = ChooseImplementation();
+    return implementation;
+}
+}
+
+const char* FindEither(const char* begin, const char* end, char first, char second) {
+    return GetImplementation().find_either(begin, end, first, second);
+}
+
+const char* GetDelimiterScanName() {
+    return GetImplementation().name;
+}
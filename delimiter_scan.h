@@ -0,0 +1,14 @@
+#pragma once
+#include <cstddef>
+
+// Returns a pointer to the first byte in [begin, end) equal to first or
+// second, or end if there is none. Scans 32 (AVX2) or 16 (SSE2) bytes at a
+// time, the implementation is picked at startup from the CPU features.
+const char* FindEither(const char* begin, const char* end, char first, char second);
+
+inline const char* FindByte(const char* begin, const char* end, char byte) {
+    return FindEither(begin, end, byte, byte);
+}
+
+// Name of the implementation in use: "avx2", "sse2" or "scalar".
+const char* GetDelimiterScanName();
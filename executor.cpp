@@ -1,47 +1,410 @@
 #include "executor.h"
 #include <cassert>
+#include <climits>
+#include <deque>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <tuple>
+#include <unistd.h>
+#include <utility>
+
+// Ready tasks of an executor; pop blocks until there is a task for the worker
+// and returns nullptr once the queue is stopped.
+class ReadyQueue {
+public:
+    virtual ~ReadyQueue() = default;
+
+    virtual void attach(size_t /*worker*/) {
+    }
+
+    virtual bool push(std::shared_ptr<Task> task) = 0;
+
+    virtual std::shared_ptr<Task> pop(size_t worker) = 0;
+
+    virtual void stop() = 0;
+
+    // Takes the tasks left after the workers are joined.
+    virtual std::vector<std::shared_ptr<Task>> drain() = 0;
+};
+
+namespace {
+class FifoQueue : public ReadyQueue {
+public:
+    bool push(std::shared_ptr<Task> task) override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (stopped_) {
+            return false;
+        }
+        tasks_.push(std::move(task));
+        queue_cv_.notify_one();
+        return true;
+    }
+
+    std::shared_ptr<Task> pop(size_t) override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        queue_cv_.wait(lock, [this] { return !tasks_.empty() || stopped_; });
+        if (stopped_) {
+            return nullptr;
+        }
+        auto task = std::move(tasks_.front());
+        tasks_.pop();
+        return task;
+    }
+
+    void stop() override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        stopped_ = true;
+        queue_cv_.notify_all();
+    }
+
+    std::vector<std::shared_ptr<Task>> drain() override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        std::vector<std::shared_ptr<Task>> tasks;
+        for (; !tasks_.empty(); tasks_.pop()) {
+            tasks.push_back(std::move(tasks_.front()));
+        }
+        return tasks;
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable queue_cv_;
+    std::queue<std::shared_ptr<Task>> tasks_;
+    bool stopped_ = false;
+};
+
+// Entries are ordered by their push number lowered by priority_aging_pushes
+// per priority level: a task of a lower priority is passed over only by
+// tasks pushed less than that many pushes per level after it.
+class PriorityQueue : public ReadyQueue {
+public:
+    bool push(std::shared_ptr<Task> task) override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (stopped_) {
+            return false;
+        }
+        int64_t order = pushes_ - static_cast<int64_t>(task->getPriority()) * priority_aging_pushes;
+        tasks_.emplace(order, pushes_++, std::move(task));
+        queue_cv_.notify_one();
+        return true;
+    }
+
+    std::shared_ptr<Task> pop(size_t) override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        queue_cv_.wait(lock, [this] { return !tasks_.empty() || stopped_; });
+        if (stopped_) {
+            return nullptr;
+        }
+        auto task = std::get<2>(tasks_.top());
+        tasks_.pop();
+        return task;
+    }
+
+    void stop() override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        stopped_ = true;
+        queue_cv_.notify_all();
+    }
+
+    std::vector<std::shared_ptr<Task>> drain() override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        std::vector<std::shared_ptr<Task>> tasks;
+        for (; !tasks_.empty(); tasks_.pop()) {
+            tasks.push_back(std::get<2>(tasks_.top()));
+        }
+        return tasks;
+    }
+
+private:
+    static constexpr int64_t priority_aging_pushes = 64;
+
+    std::mutex mutex_;
+    std::condition_variable queue_cv_;
+    MinPriorityQueue<std::tuple<int64_t, int64_t, std::shared_ptr<Task>>> tasks_;
+    int64_t pushes_ = 0;
+    bool stopped_ = false;
+};
+
+// Chase-Lev deque: the owner pushes and takes at the bottom, thieves steal
+// at the top. Grown arrays are kept until destruction because thieves may
+// still read the old ones. All accesses are sequentially consistent instead
+// of using fences, which the thread sanitizer doesn't model.
+class WorkStealingDeque {
+public:
+    WorkStealingDeque() {
+        arrays_.push_back(std::make_unique<Array>(initial_capacity));
+        array_ = arrays_.back().get();
+    }
+
+    void push(Task* task) {
+        int64_t bottom = bottom_.load();
+        int64_t top = top_.load();
+        Array* array = array_.load();
+        if (bottom - top >= static_cast<int64_t>(array->capacity)) {
+            array = grow(array, top, bottom);
+        }
+        array->put(bottom, task);
+        bottom_.store(bottom + 1);
+    }
+
+    Task* take() {
+        int64_t bottom = bottom_.load() - 1;
+        Array* array = array_.load();
+        bottom_.store(bottom);
+        int64_t top = top_.load();
+        if (top > bottom) {
+            bottom_.store(bottom + 1);
+            return nullptr;
+        }
+        Task* task = array->get(bottom);
+        if (top == bottom) {
+            if (!top_.compare_exchange_strong(top, top + 1)) {
+                task = nullptr;
+            }
+            bottom_.store(bottom + 1);
+        }
+        return task;
+    }
+
+    Task* steal() {
+        int64_t top = top_.load();
+        int64_t bottom = bottom_.load();
+        if (top >= bottom) {
+            return nullptr;
+        }
+        Task* task = array_.load()->get(top);
+        if (!top_.compare_exchange_strong(top, top + 1)) {
+            return nullptr;
+        }
+        return task;
+    }
+
+    bool empty() const {
+        return top_.load() >= bottom_.load();
+    }
+
+private:
+    static constexpr size_t initial_capacity = 256;
+
+    struct Array {
+        explicit Array(size_t size) : capacity(size), slots(size) {
+        }
+
+        Task* get(int64_t index) const {
+            return slots[index & (capacity - 1)].load();
+        }
+
+        void put(int64_t index, Task* task) {
+            slots[index & (capacity - 1)].store(task);
+        }
+
+        const size_t capacity;
+        std::vector<std::atomic<Task*>> slots;
+    };
+
+    std::atomic<int64_t> top_{0};
+    std::atomic<int64_t> bottom_{0};
+    std::atomic<Array*> array_;
+    std::vector<std::unique_ptr<Array>> arrays_;
+
+    Array* grow(Array* array, int64_t top, int64_t bottom) {
+        arrays_.push_back(std::make_unique<Array>(array->capacity * 2));
+        Array* grown = arrays_.back().get();
+        for (int64_t index = top; index < bottom; ++index) {
+            grown->put(index, array->get(index));
+        }
+        array_.store(grown);
+        return grown;
+    }
+};
+
+// The word is a 32 bit atomic, e.g. an epoch or a task status.
+void FutexWait(const void* word, uint32_t expected) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
 
+void FutexWake(const void* word, int count) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
+
+thread_local const ReadyQueue* current_queue = nullptr;
+thread_local size_t current_worker = 0;
+
+// Inline tasks completing further inline tasks nest on the stack; deeper
+// ones are queued instead.
+const size_t max_inline_depth = 16;
+
+thread_local size_t inline_depth = 0;
+
+// Priority of the task running on this thread, tasks it submits get a higher one.
+thread_local int running_priority = -1;
+}
+
+// Tasks submitted from outside the workers go through a locked injection
+// queue. Idle workers park on a futex event count: a worker announces itself
+// as a sleeper, looks for work once more and sleeps only if no task was
+// pushed since, so a push never needs a lock to wake it.
+class WorkStealingQueue : public ReadyQueue {
+public:
+    explicit WorkStealingQueue(size_t workers) : deques_(workers) {
+    }
+
+    void attach(size_t worker) override {
+        current_queue = this;
+        current_worker = worker;
+    }
+
+    bool push(std::shared_ptr<Task> task) override {
+        if (stopped_) {
+            return false;
+        }
+        Task* raw_task = task.get();
+        raw_task->queued_self_ = std::move(task);
+        if (current_queue == this) {
+            deques_[current_worker].push(raw_task);
+        } else {
+            std::unique_lock<std::mutex> lock(injected_mutex_);
+            injected_.push_back(raw_task);
+            has_injected_ = true;
+        }
+        if (sleepers_.load() > 0) {
+            epoch_.fetch_add(1);
+            FutexWake(&epoch_, 1);
+        }
+        return true;
+    }
+
+    std::shared_ptr<Task> pop(size_t worker) override {
+        while (true) {
+            if (Task* task = find(worker)) {
+                return std::move(task->queued_self_);
+            }
+            uint32_t epoch = epoch_.load();
+            ++sleepers_;
+            if (Task* task = find(worker)) {
+                --sleepers_;
+                return std::move(task->queued_self_);
+            }
+            if (stopped_) {
+                --sleepers_;
+                return nullptr;
+            }
+            FutexWait(&epoch_, epoch);
+            --sleepers_;
+        }
+    }
+
+    void stop() override {
+        stopped_ = true;
+        epoch_.fetch_add(1);
+        FutexWake(&epoch_, INT_MAX);
+    }
+
+    std::vector<std::shared_ptr<Task>> drain() override {
+        std::vector<std::shared_ptr<Task>> tasks;
+        for (auto& deque : deques_) {
+            while (Task* task = deque.steal()) {
+                tasks.push_back(std::move(task->queued_self_));
+            }
+        }
+        std::unique_lock<std::mutex> lock(injected_mutex_);
+        for (Task* task : injected_) {
+            tasks.push_back(std::move(task->queued_self_));
+        }
+        injected_.clear();
+        has_injected_ = false;
+        return tasks;
+    }
+
+private:
+    std::vector<WorkStealingDeque> deques_;
+    std::mutex injected_mutex_;
+    std::deque<Task*> injected_;
+    std::atomic<bool> has_injected_{false};
+    std::atomic<bool> stopped_{false};
+    std::atomic<uint32_t> epoch_{0};
+    std::atomic<int> sleepers_{0};
+
+    // Own deque first, then the injected tasks, then the other workers.
+    Task* find(size_t worker) {
+        if (Task* task = deques_[worker].take()) {
+            return task;
+        }
+        if (has_injected_) {
+            std::unique_lock<std::mutex> lock(injected_mutex_);
+            if (!injected_.empty()) {
+                Task* task = injected_.front();
+                injected_.pop_front();
+                has_injected_ = !injected_.empty();
+                return task;
+            }
+        }
+        for (size_t i = 1; i < deques_.size(); ++i) {
+            if (Task* task = deques_[(worker + i) % deques_.size()].steal()) {
+                return task;
+            }
+        }
+        return nullptr;
+    }
+};
+
+struct Task::Dependant {
+    std::shared_ptr<Task> task;
+    bool trigger = false;
+    Dependant* next = nullptr;
+};
+
+Task::Dependant Task::finished_mark_;
+
+Task::~Task() {
+    Dependant* dependant = dependants_.load();
+    while (dependant != nullptr && dependant != &finished_mark_) {
+        delete std::exchange(dependant, dependant->next);
+    }
+}
+
+// The count is raised before the edge is published, so a dependency finishing
+// in between can't bring it to zero while the task is being built.
 void Task::addDependency(std::shared_ptr<Task> dep) {
-    std::unique_lock<std::shared_mutex> lock(mutex_);
     assert(!isTaskStarted());
-    if (dep->addDependant(shared_from_this())) {
-        dependency_count_ = dependency_count_.value_or(0) + 1;
+    priority_ = std::max(priority_.load(), dep->priority_.load() + 1);
+    ++dependency_count_;
+    if (dep->addDependant(shared_from_this(), false)) {
+        has_dependencies_ = true;
+    } else {
+        --dependency_count_;
     }
 }
 
 void Task::addTrigger(std::shared_ptr<Task> dep) {
-    std::unique_lock<std::shared_mutex> lock(mutex_);
     assert(!isTaskStarted());
-    trigger_ = trigger_.value_or(false);
-    if (!dep->addTriggered(shared_from_this())) {
-        trigger_ = true;
-        submit(lock);
+    if (!has_triggers_) {
+        has_triggers_ = true;
+        ++dependency_count_;
+    }
+    if (!dep->addDependant(shared_from_this(), true)) {
+        trigger();
     }
 }
 
 void Task::setTimeTrigger(std::chrono::system_clock::time_point at) {
-    std::unique_lock<std::shared_mutex> lock(mutex_);
     assert(!isTaskStarted());
     time_trigger_ = at;
 }
 
 bool Task::isCompleted() const {
-    std::shared_lock<std::shared_mutex> lock(mutex_);
     return isTaskCompleted();
 }
 
 bool Task::isFailed() const {
-    std::shared_lock<std::shared_mutex> lock(mutex_);
     return isTaskFailed();
 }
 
 bool Task::isCanceled() const {
-    std::shared_lock<std::shared_mutex> lock(mutex_);
     return isTaskCanceled();
 }
 
 bool Task::isFinished() const {
-    std::shared_lock<std::shared_mutex> lock(mutex_);
     return isTaskFinished();
 }
 
@@ -50,16 +413,40 @@ std::exception_ptr Task::getError() const {
 }
 
 void Task::cancel() {
-    std::unique_lock<std::shared_mutex> lock(mutex_);
-    if (!isTaskStarted()) {
-        status_ = TaskStatus::Canceled;
-        finish(lock);
+    auto status = status_.load();
+    while (status <= TaskStatus::Pending) {
+        if (status_.compare_exchange_weak(status, TaskStatus::Canceled)) {
+            finish();
+            return;
+        }
     }
 }
 
 void Task::wait() {
-    std::unique_lock<std::shared_mutex> lock(mutex_);
-    finished_cv_.wait(lock, [this] { return isTaskFinished(); });
+    waitFinished();
+}
+
+void Task::setRunInline() {
+    assert(!isTaskStarted());
+    run_inline_ = true;
+}
+
+void Task::setPriority(int priority) {
+    assert(!isTaskStarted());
+    priority_ = priority;
+}
+
+int Task::getPriority() const {
+    return priority_;
+}
+
+void Task::setResourceClass(ResourceClass resource_class) {
+    assert(!isTaskStarted());
+    resource_class_ = resource_class;
+}
+
+ResourceClass Task::getResourceClass() const {
+    return resource_class_;
 }
 
 bool Task::isTaskCompleted() const {
@@ -75,129 +462,122 @@ bool Task::isTaskCanceled() const {
 }
 
 bool Task::isTaskFinished() const {
-    return static_cast<int>(status_) > 1;
+    return status_ >= TaskStatus::Completed;
 }
 
 bool Task::isTaskStarted() const {
     return status_ != TaskStatus::Created;
 }
 
-bool Task::canSubmit() const {
-    return static_cast<int>(status_) < 0 && !executor_.expired() &&
-        dependency_count_.value_or(0) == 0 && trigger_.value_or(true) &&
-        !(!dependency_count_.has_value() && !trigger_.has_value() && time_trigger_.has_value());
+// Taken by the timer; a task submitted by its dependencies meanwhile stays queued once.
+bool Task::setPending() {
+    auto status = TaskStatus::Timered;
+    return status_.compare_exchange_strong(status, TaskStatus::Pending);
 }
 
 bool Task::setInProgress() {
-    std::unique_lock<std::shared_mutex> lock(mutex_);
-    if (status_ == TaskStatus::Pending || status_ == TaskStatus::Timered) {
-        status_ = TaskStatus::InProgress;
-        return true;
-    } else {
-        return false;
-    }
+    auto status = TaskStatus::Pending;
+    return status_.compare_exchange_strong(status, TaskStatus::InProgress);
 }
 
 void Task::setFailed(std::exception_ptr err) {
-    std::unique_lock<std::shared_mutex> lock(mutex_);
     err_ = std::move(err);
     status_ = TaskStatus::Failed;
-    finish(lock);
+    finish();
 }
 
 void Task::setCompleted() {
-    std::unique_lock<std::shared_mutex> lock(mutex_);
     status_ = TaskStatus::Completed;
-    finish(lock);
+    finish();
 }
 
-void Task::finish(std::unique_lock<std::shared_mutex>& lock) {
-    finished_cv_.notify_all();
-    lock.unlock();
-    for (const auto& weak_dependant : dependants_) {
-        if (!weak_dependant.expired()) {
-            auto dependant = weak_dependant.lock();
-            dependant->removeDependency();
-        }
+void Task::finish() {
+    if (waiters_ > 0) {
+        FutexWake(&status_, INT_MAX);
     }
-    for (const auto& weak_triggered : triggers_) {
-        if (!weak_triggered.expired()) {
-            auto triggered = weak_triggered.lock();
-            triggered->trigger();
+    Dependant* dependant = dependants_.exchange(&finished_mark_);
+    while (dependant != nullptr) {
+        if (dependant->trigger) {
+            dependant->task->trigger();
+        } else {
+            dependant->task->removeDependency();
         }
+        delete std::exchange(dependant, dependant->next);
     }
-    lock.lock();
 }
 
-void Task::submit(std::unique_lock<std::shared_mutex>& lock) {
-    if (!canSubmit()) {
-        return;
-    }
-    status_ = TaskStatus::Pending;
-    lock.unlock();
-    std::shared_ptr<Executor> executor = executor_.lock();
-    bool accepted = executor->addToDo(shared_from_this());
-    lock.lock();
-    if (!accepted) {
-        status_ = TaskStatus::Canceled;
+void Task::submit() {
+    auto status = status_.load();
+    do {
+        if (status != TaskStatus::Created && status != TaskStatus::Timered) {
+            return;
+        }
+    } while (!status_.compare_exchange_weak(status, TaskStatus::Pending));
+    if (auto executor = executor_.lock()) {
+        if (run_inline_) {
+            executor->runInline(shared_from_this());
+        } else {
+            executor->addToDo(shared_from_this());
+        }
+    } else {
+        cancel();
     }
 }
 
-void Task::submitTimer(std::unique_lock<std::shared_mutex>& lock) {
-    if (time_trigger_.has_value()) {
-        status_ = TaskStatus::Timered;
-        lock.unlock();
-        std::shared_ptr<Executor> executor = executor_.lock();
-        executor->addTimerTask(time_trigger_.value(), shared_from_this());
-        lock.lock();
+// The waiter is counted before it checks the status, and finish() checks the
+// count after the final status is stored, so one of them sees the other.
+void Task::waitFinished() const {
+    static_assert(sizeof(status_) == sizeof(uint32_t));
+    if (isTaskFinished()) {
+        return;
     }
-}
-
-bool Task::addDependant(std::shared_ptr<Task> dependant) {
-    std::unique_lock<std::shared_mutex> lock(mutex_);
-    if (!isTaskFinished()) {
-        dependants_.push_back(dependant);
-        return true;
-    } else {
-        return false;
+    ++waiters_;
+    for (auto status = status_.load(); status < TaskStatus::Completed; status = status_.load()) {
+        FutexWait(&status_, static_cast<uint32_t>(status));
     }
+    --waiters_;
 }
 
-bool Task::addTriggered(std::shared_ptr<Task> triggered) {
-    std::unique_lock<std::shared_mutex> lock(mutex_);
-    if (!isTaskFinished()) {
-        triggers_.push_back(triggered);
-        return true;
-    } else {
-        return false;
-    }
+bool Task::addDependant(std::shared_ptr<Task> dependant, bool trigger) {
+    auto edge = new Dependant{dependant, trigger, dependants_.load()};
+    do {
+        if (edge->next == &finished_mark_) {
+            delete edge;
+            return false;
+        }
+    } while (!dependants_.compare_exchange_weak(edge->next, edge));
+    return true;
 }
 
 void Task::removeDependency() {
-    std::unique_lock<std::shared_mutex> lock(mutex_);
-    assert(dependency_count_.has_value());
-    dependency_count_ = dependency_count_.value() - 1;
-    if (dependency_count_ == 0) {
-        submit(lock);
+    if (--dependency_count_ == 0) {
+        submit();
     }
 }
 
 void Task::trigger() {
-    std::unique_lock<std::shared_mutex> lock(mutex_);
-    trigger_ = true;
-    submit(lock);
+    if (!triggered_.exchange(true)) {
+        removeDependency();
+    }
 }
 
+// A task with only a time trigger keeps its count above zero and is
+// submitted by the timer alone.
 bool Task::setExecutor(std::shared_ptr<Executor> executor) {
-    std::unique_lock<std::shared_mutex> lock(mutex_);
-    if (executor_.expired()) {
-        executor_ = executor;
-        submitTimer(lock);
-        submit(lock);
-        return true;
-    } else {
+    if (bound_.exchange(true)) {
         return false;
     }
+    executor_ = executor;
+    // A task that has already left Created, e.g. canceled before it was
+    // bound, gets no timer.
+    auto status = TaskStatus::Created;
+    if (time_trigger_.has_value() && status_.compare_exchange_strong(status, TaskStatus::Timered)) {
+        executor->addTimerTask(time_trigger_.value(), shared_from_this());
+    }
+    if (!time_trigger_.has_value() || has_dependencies_ || has_triggers_) {
+        removeDependency();
+    }
+    return true;
 }
 
 void TimerHeap::push(std::chrono::system_clock::time_point timer, std::shared_ptr<Task> task) {
@@ -232,57 +612,99 @@ void TimerHeap::stop() {
     timer_cv_.notify_all();
 }
 
-Executor::Executor(size_t concurrency_) {
-    for (size_t i = 0; i < concurrency_; ++i) {
-        threads_.emplace_back([this] {
-          std::unique_lock<std::mutex> lock(mutex_);
-          while (true) {
-              queue_cv_.wait(lock, [this] { return !to_do_list_.empty() || shut_down_; });
-              if (shut_down_) {
-                  break;
-              }
-              while (!to_do_list_.empty() && !to_do_list_.front()->setInProgress()) {
-                  to_do_list_.pop();
-              }
-              if (to_do_list_.empty()) {
-                  continue;
-              }
-              std::shared_ptr<Task> task = to_do_list_.front();
-              to_do_list_.pop();
-
-              lock.unlock();
-              try {
-                  task->run();
-                  task->setCompleted();
-              } catch (...) {
-                  task->setFailed(std::current_exception());
-              }
-              lock.lock();
-
-              submited_tasks_.erase(task);
-          }
-        });
-        threads_.emplace_back([this] {
-          while (!shut_down_) {
-              std::shared_ptr<Task> task = timer_heap_.pop();
-              if (task) {
-                  addToDo(task);
-              }
-          }
-        });
+std::vector<std::shared_ptr<Task>> TimerHeap::drain() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::vector<std::shared_ptr<Task>> tasks;
+    for (; !timers_.empty(); timers_.pop()) {
+        tasks.push_back(timers_.top().second);
     }
+    return tasks;
+}
+
+Executor::Executor(size_t concurrency_, SchedulingPolicy policy)
+    : Executor(ResourceLimits{concurrency_}, policy) {
+}
+
+Executor::Executor(ResourceLimits limits, SchedulingPolicy policy) {
+    if (limits.cpu == 0) {
+        throw std::runtime_error("Executor needs at least one cpu worker");
+    }
+    for (size_t workers : {limits.cpu, limits.subprocess, limits.io}) {
+        if (workers == 0) {
+            ready_queues_.emplace_back();
+        } else if (policy == SchedulingPolicy::WorkStealing) {
+            ready_queues_.push_back(std::make_unique<WorkStealingQueue>(workers));
+        } else if (policy == SchedulingPolicy::Priority) {
+            ready_queues_.push_back(std::make_unique<PriorityQueue>());
+        } else {
+            ready_queues_.push_back(std::make_unique<FifoQueue>());
+        }
+        for (size_t i = 0; i < workers; ++i) {
+            threads_.emplace_back([this, &ready_queue = *ready_queues_.back(), i] {
+              workerLoop(ready_queue, i);
+            });
+        }
+    }
+    threads_.emplace_back([this] {
+      while (!shut_down_) {
+          std::shared_ptr<Task> task = timer_heap_.pop();
+          if (task && task->setPending()) {
+              addToDo(task);
+          }
+      }
+    });
 }
 
 Executor::~Executor() {
     setShutDown();
     joinThreads();
+    // Tasks pushed while the threads were joined would leak through the queues.
+    cancelQueued();
+}
+
+ReadyQueue& Executor::getReadyQueue(ResourceClass resource_class) {
+    const auto& ready_queue = ready_queues_[static_cast<size_t>(resource_class)];
+    return ready_queue ? *ready_queue : *ready_queues_.front();
+}
+
+void Executor::workerLoop(ReadyQueue& ready_queue, size_t worker) {
+    ready_queue.attach(worker);
+    while (auto task = ready_queue.pop(worker)) {
+        execute(std::move(task));
+    }
+}
+
+void Executor::execute(std::shared_ptr<Task> task) {
+    if (!task->setInProgress()) {
+        return;
+    }
+    int submitter_priority = std::exchange(running_priority, task->getPriority());
+    try {
+        task->run();
+        task->setCompleted();
+    } catch (...) {
+        task->setFailed(std::current_exception());
+    }
+    running_priority = submitter_priority;
+}
+
+void Executor::runInline(std::shared_ptr<Task> task) {
+    if (shut_down_ || inline_depth >= max_inline_depth) {
+        addToDo(std::move(task));
+        return;
+    }
+    ++inline_depth;
+    execute(std::move(task));
+    --inline_depth;
 }
 
+// Nothing is registered: until the task runs it is owned by the edges of its
+// dependencies, its ready queue or the timer heap.
 void Executor::submit(std::shared_ptr<Task> task) {
-    if (task->setExecutor(shared_from_this())) {
-        std::unique_lock<std::mutex> lock(mutex_);
-        submited_tasks_.insert(task);
+    if (task->getPriority() <= running_priority && !task->isTaskStarted()) {
+        task->priority_ = running_priority + 1;
     }
+    task->setExecutor(shared_from_this());
 }
 
 void Executor::startShutdown() {
@@ -297,11 +719,14 @@ void Executor::setShutDown() {
     if (in_shut_down_.test_and_set()) {
         return;
     }
-    std::unique_lock<std::mutex> queue_lock(mutex_);
     std::unique_lock<std::mutex> shut_down_lock(shut_down_mutex_);
     shut_down_ = true;
     timer_heap_.stop();
-    queue_cv_.notify_all();
+    for (const auto& ready_queue : ready_queues_) {
+        if (ready_queue) {
+            ready_queue->stop();
+        }
+    }
     shut_down_cv_.notify_one();
 }
 
@@ -315,25 +740,33 @@ void Executor::joinThreads() {
     for (auto& thread : threads_) {
         thread.join();
     }
-    while (!to_do_list_.empty()) {
-        to_do_list_.front()->cancel();
-        to_do_list_.pop();
-    }
-    submited_tasks_.clear();
+    cancelQueued();
     status_ = ExecutorStatus::Finished;
     shut_down_cv_.notify_all();
 }
 
+// Canceling a task finishes it, which cancels the tasks waiting for it in turn
+// as the stopped executor refuses their submit.
+void Executor::cancelQueued() {
+    for (const auto& ready_queue : ready_queues_) {
+        if (!ready_queue) {
+            continue;
+        }
+        for (const auto& task : ready_queue->drain()) {
+            task->cancel();
+        }
+    }
+    for (const auto& task : timer_heap_.drain()) {
+        task->cancel();
+    }
+}
+
 bool Executor::addToDo(std::shared_ptr<Task> task) {
-    std::unique_lock<std::mutex> lock(mutex_);
-    if (!shut_down_) {
-        to_do_list_.push(std::move(task));
-        queue_cv_.notify_one();
+    if (!shut_down_ && getReadyQueue(task->getResourceClass()).push(task)) {
         return true;
-    } else {
-        task->cancel();
-        return false;
     }
+    task->cancel();
+    return false;
 }
 
 void Executor::addTimerTask(std::chrono::system_clock::time_point timer,
@@ -341,6 +774,10 @@ void Executor::addTimerTask(std::chrono::system_clock::time_point timer,
     timer_heap_.push(timer, std::move(task));
 }
 
-std::shared_ptr<Executor> MakeThreadPoolExecutor(int num_threads) {
-    return std::make_shared<Executor>(num_threads);
+std::shared_ptr<Executor> MakeThreadPoolExecutor(int num_threads, SchedulingPolicy policy) {
+    return std::make_shared<Executor>(num_threads, policy);
+}
+
+std::shared_ptr<Executor> MakeThreadPoolExecutor(ResourceLimits limits, SchedulingPolicy policy) {
+    return std::make_shared<Executor>(limits, policy);
 }
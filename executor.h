@@ -9,15 +9,27 @@
 #include <atomic>
 #include <iostream>
 #include <optional>
-#include <shared_mutex>
-#include <unordered_set>
 
 class Executor;
 
+class ReadyQueue;
+
+// What a task mostly spends its time on: computing in memory, waiting for a
+// child process or moving table bytes on disk.
+enum class ResourceClass {
+    Cpu = 0,
+    Subprocess = 1,
+    Io = 2
+};
+
+// Tasks change state without locks: the status only moves forward with
+// compare and swap, dependencies are counted down atomically and dependant
+// edges are pushed onto a lock-free list that finish() closes and walks.
+// An edge owns its dependant, so a task waiting for others is kept alive by
+// them, and a ready one by its queue.
 class Task : public std::enable_shared_from_this<Task> {
 public:
-    virtual ~Task() {
-    }
+    virtual ~Task();
 
     virtual void run() = 0;
 
@@ -41,32 +53,61 @@ public:
 
     void wait();
 
+    // Makes the task run on the thread that satisfies its last dependency
+    // instead of going through the ready queue. Only for cheap continuations
+    // that never block, e.g. glue passing table paths between stages.
+    void setRunInline();
+
+    // The Priority policy takes ready tasks of a higher priority first. A task
+    // gets at least one more than its dependencies and than the task that
+    // submits it, so later stages of a job go ahead of earlier ones; an
+    // explicit priority set before the submit is only ever raised.
+    void setPriority(int priority);
+
+    int getPriority() const;
+
+    // Routes the task to the workers of the class; Cpu by default.
+    void setResourceClass(ResourceClass resource_class);
+
+    ResourceClass getResourceClass() const;
+
 protected:
-    enum class TaskStatus {
-        Created = -2,
-        Timered = -1,
-        Pending = 0,
-        InProgress = 1,
-        Completed = 2,
-        Failed = 3,
-        Canceled = 4
+    // Statuses from Completed on are final.
+    enum class TaskStatus : uint32_t {
+        Created = 0,
+        Timered = 1,
+        Pending = 2,
+        InProgress = 3,
+        Completed = 4,
+        Failed = 5,
+        Canceled = 6
     };
 
-    std::weak_ptr<Executor> executor_;
+    // An edge to a task waiting for this one, either as a dependency or as a trigger.
+    struct Dependant;
 
-    mutable std::shared_mutex mutex_;
-    mutable std::condition_variable_any finished_cv_;
+    std::weak_ptr<Executor> executor_;
+    std::atomic<bool> bound_{false};
 
-    TaskStatus status_ = TaskStatus::Created;
+    std::atomic<TaskStatus> status_{TaskStatus::Created};
     std::exception_ptr err_ = nullptr;
 
-    std::optional<size_t> dependency_count_ = std::nullopt;
-    std::vector<std::weak_ptr<Task>> dependants_;
-
-    std::optional<bool> trigger_ = std::nullopt;
-    std::vector<std::weak_ptr<Task>> triggers_;
+    // Unfinished dependencies, plus one until the task is given to an executor
+    // and one more until the first trigger fires if there are triggers.
+    std::atomic<size_t> dependency_count_{1};
+    bool has_dependencies_ = false;
+    bool has_triggers_ = false;
+    std::atomic<bool> triggered_{false};
+    std::atomic<Dependant*> dependants_{nullptr};
 
     std::optional<std::chrono::system_clock::time_point> time_trigger_ = std::nullopt;
+    bool run_inline_ = false;
+    // Read by dependants being built on other threads while submit raises it.
+    std::atomic<int> priority_{0};
+    ResourceClass resource_class_ = ResourceClass::Cpu;
+
+    // Threads blocked in waitFinished(); finish() only wakes when there are any.
+    mutable std::atomic<uint32_t> waiters_{0};
 
     bool isTaskCompleted() const;
 
@@ -78,7 +119,7 @@ protected:
 
     bool isTaskStarted() const;
 
-    bool canSubmit() const;
+    bool setPending();
 
     bool setInProgress();
 
@@ -86,15 +127,13 @@ protected:
 
     void setCompleted();
 
-    virtual void finish(std::unique_lock<std::shared_mutex>& lock);
+    void finish();
 
-    void submit(std::unique_lock<std::shared_mutex>& lock);
+    void submit();
 
-    void submitTimer(std::unique_lock<std::shared_mutex>& lock);
+    void waitFinished() const;
 
-    bool addDependant(std::shared_ptr<Task> dependant);
-
-    bool addTriggered(std::shared_ptr<Task> triggered);
+    bool addDependant(std::shared_ptr<Task> dependant, bool trigger);
 
     void removeDependency();
 
@@ -103,6 +142,15 @@ protected:
     bool setExecutor(std::shared_ptr<Executor> executor);
 
     friend class Executor;
+
+private:
+    // Marks the dependants list of a finished task.
+    static Dependant finished_mark_;
+
+    // Keeps the task alive while a lock-free ready queue holds it by pointer.
+    std::shared_ptr<Task> queued_self_;
+
+    friend class WorkStealingQueue;
 };
 
 template <class T>
@@ -116,6 +164,9 @@ public:
 
     void stop();
 
+    // Takes the tasks still waiting for their time after the executor stopped.
+    std::vector<std::shared_ptr<Task>> drain();
+
 private:
     bool stopped_ = false;
     mutable std::mutex mutex_;
@@ -134,9 +185,30 @@ using ExecutorPtr = std::shared_ptr<Executor>;
 
 struct Unit {};
 
+// Fifo runs the ready tasks in submission order from one locked queue.
+// WorkStealing gives every worker a deque of its own: tasks submitted by a
+// worker go to its deque, idle workers steal from the others. Priority keeps
+// one locked queue ordered by task priority, aged so nothing starves.
+enum class SchedulingPolicy {
+    Fifo,
+    WorkStealing,
+    Priority
+};
+
+// Worker threads of every resource class, which bounds the tasks of the
+// class running at once. A class without workers of its own runs on the Cpu
+// workers.
+struct ResourceLimits {
+    size_t cpu = 1;
+    size_t subprocess = 0;
+    size_t io = 0;
+};
+
 class Executor : public std::enable_shared_from_this<Executor> {
 public:
-    explicit Executor(size_t concurrency_);
+    explicit Executor(size_t concurrency_, SchedulingPolicy policy = SchedulingPolicy::WorkStealing);
+
+    explicit Executor(ResourceLimits limits, SchedulingPolicy policy = SchedulingPolicy::WorkStealing);
 
     virtual ~Executor();
 
@@ -154,8 +226,11 @@ public:
     }
 
     template <class Y, class T>
-    FuturePtr<Y> then(FuturePtr<T> input, std::function<Y()> fn) {
+    FuturePtr<Y> then(FuturePtr<T> input, std::function<Y()> fn, bool run_inline = false) {
         auto future = std::make_shared<Future<Y>>(fn);
+        if (run_inline) {
+            future->setRunInline();
+        }
         future->addDependency(input);
         submit(future);
         return future;
@@ -164,15 +239,25 @@ public:
     template <class T>
     FuturePtr<T> redirect(FuturePtr<FuturePtr<T>> double_future) {
         auto future = std::make_shared<Future<T>>();
+        future->setRunInline();
         then<Unit>(double_future, [=] {
-            auto task = double_future->get();
+            FuturePtr<T> task;
+            try {
+                task = double_future->get();
+            } catch (...) {
+                future->setFunc([error = std::current_exception()]() -> T {
+                    std::rethrow_exception(error);
+                });
+                submit(future);
+                throw;
+            }
             future->addDependency(task);
             future->setFunc([task] {
                 return task->get();
             });
             submit(future);
             return Unit{};
-        });
+        }, true);
 
         return future;
     }
@@ -186,6 +271,7 @@ public:
           }
           return result;
         });
+        future->setRunInline();
         for (auto item : all) {
             future->addDependency(item);
         }
@@ -203,6 +289,7 @@ public:
           }
           throw std::runtime_error("Bad trigger");
         });
+        future->setRunInline();
         for (auto item : all) {
             future->addTrigger(item);
         }
@@ -241,13 +328,9 @@ private:
     mutable std::mutex shut_down_mutex_;
     mutable std::condition_variable shut_down_cv_;
 
-    mutable std::mutex mutex_;
-    mutable std::condition_variable queue_cv_;
-
     std::vector<std::thread> threads_;
-    std::queue<std::shared_ptr<Task>> to_do_list_;
-
-    std::unordered_set<std::shared_ptr<Task>> submited_tasks_;
+    // Indexed by ResourceClass, empty for classes without workers.
+    std::vector<std::unique_ptr<ReadyQueue>> ready_queues_;
 
     TimerHeap timer_heap_;
 
@@ -255,6 +338,16 @@ private:
 
     void joinThreads();
 
+    void cancelQueued();
+
+    ReadyQueue& getReadyQueue(ResourceClass resource_class);
+
+    void workerLoop(ReadyQueue& ready_queue, size_t worker);
+
+    void execute(std::shared_ptr<Task> task);
+
+    void runInline(std::shared_ptr<Task> task);
+
     bool addToDo(std::shared_ptr<Task> task);
 
     void addTimerTask(std::chrono::system_clock::time_point timer, std::shared_ptr<Task> task);
@@ -262,7 +355,11 @@ private:
     friend class Task;
 };
 
-std::shared_ptr<Executor> MakeThreadPoolExecutor(int num_threads);
+std::shared_ptr<Executor> MakeThreadPoolExecutor(int num_threads,
+                                                 SchedulingPolicy policy = SchedulingPolicy::WorkStealing);
+
+std::shared_ptr<Executor> MakeThreadPoolExecutor(ResourceLimits limits,
+                                                 SchedulingPolicy policy = SchedulingPolicy::WorkStealing);
 
 template <class T>
 class Future : public Task {
@@ -273,7 +370,6 @@ public:
     }
 
     void setFunc(const std::function<T()>& func) {
-        std::unique_lock<std::shared_mutex> lock(Task::mutex_);
         if (isTaskStarted()) {
             throw std::runtime_error("Attempt to change started task function");
         }
@@ -281,14 +377,11 @@ public:
     }
 
     void run() override {
-        T result = function_();
-        std::unique_lock<std::shared_mutex> lock(Task::mutex_);
-        result_ = result;
+        result_ = function_();
     }
 
     T get() const {
-        std::shared_lock<std::shared_mutex> lock(Task::mutex_);
-        result_cv_.wait(lock, [this] { return Task::isTaskFinished(); });
+        waitFinished();
         if (Task::isTaskCompleted()) {
             return result_.value();
         } else if (Task::isTaskFailed()) {
@@ -299,24 +392,17 @@ public:
     }
 
     void setResult(const T& result) {
-        std::unique_lock<std::shared_mutex> lock(Task::mutex_);
-        if (isTaskStarted()) {
+        auto status = TaskStatus::Created;
+        if (!status_.compare_exchange_strong(status, TaskStatus::InProgress)) {
             throw std::runtime_error("Attempt to change started task function");
         }
         result_ = result;
-        status_ = TaskStatus::Completed;
-        finish(lock);
+        setCompleted();
     }
 
 protected:
-    mutable std::condition_variable_any result_cv_;
     std::function<T()> function_;
     std::optional<T> result_ = std::nullopt;
-
-    void finish(std::unique_lock<std::shared_mutex>& lock) override {
-        Task::finish(lock);
-        result_cv_.notify_all();
-    }
 };
 
 
@@ -1,36 +1,239 @@
 #include <string>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <iostream>
+#include <optional>
+#include <unistd.h>
 #include "mapreduce.h"
+#include "native_scripts.h"
+#include "worker_pool.h"
+
+// Compressed stages are given as a comma separated list, e.g. "sort,merge", or "none".
+void SetCompressedStages(const std::string& stages) {
+    auto format = [&stages](const std::string& stage) {
+        return stages.find(stage) != std::string::npos ? TableFormat::CompressedBinary : TableFormat::Binary;
+    };
+    stage_settings.split = format("split");
+    stage_settings.sort = format("sort");
+    stage_settings.merge = format("merge");
+}
+
+// Worker limits are given as a comma separated list of class=count, e.g.
+// "cpu=4,subprocess=8,io=2"; classes left out keep their defaults.
+void SetResourceLimits(ResourceLimits& limits, const std::string& classes) {
+    size_t begin = 0;
+    while (begin < classes.size()) {
+        size_t end = std::min(classes.find(',', begin), classes.size());
+        std::string item = classes.substr(begin, end - begin);
+        size_t equals = item.find('=');
+        if (equals == std::string::npos) {
+            throw std::runtime_error("Bad worker limit " + item);
+        }
+        std::string resource_class = item.substr(0, equals);
+        size_t workers = std::stoul(item.substr(equals + 1));
+        if (resource_class == "cpu") {
+            limits.cpu = workers;
+        } else if (resource_class == "subprocess") {
+            limits.subprocess = workers;
+        } else if (resource_class == "io") {
+            limits.io = workers;
+        } else {
+            throw std::runtime_error("Unknown resource class " + resource_class);
+        }
+        begin = end + 1;
+    }
+}
+
+// Prints rows with the given key, or with keys in [first, last) if last is given.
+void Lookup(const std::string& table_path, const std::string& first, const std::optional<std::string>& last) {
+    TableReader table(table_path);
+    TableWriter output(dup(STDOUT_FILENO));
+    if (last.has_value()) {
+        table.SeekRange(first, last.value());
+    } else {
+        table.Seek(first);
+        table.SetUpperBound(first + '\0');
+    }
+    output.Append(table);
+    output.Close();
+}
+
+// Moves the result table to the output path, decoding intermediate binary
+// tables to text unless binary output is asked for. A failed copy leaves no
+// truncated output behind.
+void MoveResult(const std::string& result_path, const std::string& output_path, bool binary_output) {
+    auto result_format = DetectTableFormat(result_path);
+    bool as_is = binary_output || result_format == TableFormat::Text;
+    // A result on another file system can't be renamed and is copied as is.
+    if (as_is && rename(result_path.c_str(), output_path.c_str()) == 0) {
+        return;
+    }
+    try {
+        TableWriter output(output_path, as_is ? result_format : TableFormat::Text);
+        if (as_is) {
+            output.AppendTable(result_path);
+        } else {
+            output.Append(result_path);
+        }
+        output.Close();
+    } catch (...) {
+        unlink(output_path.c_str());
+        throw;
+    }
+    unlink(result_path.c_str());
+}
 
 int main(int argc, char** argv) {
     std::vector<std::string> pos_args;
     int block_size = 100'000;
+    bool binary_output = false;
+    size_t partitions = 0;
+    Combiner combiner;
+    SchedulingPolicy scheduling = SchedulingPolicy::WorkStealing;
+    // Child processes mostly compute too, so they get a slot per core as well.
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    ResourceLimits limits{cores, cores, 2};
     for (int i = 1; i < argc; ++i) {
         if (std::string(argv[i]) == "-b") {
             block_size = std::stoi(argv[++i]);
+        } else if (std::string(argv[i]) == "-z") {
+            SetCompressedStages(argv[++i]);
+        } else if (std::string(argv[i]) == "-i") {
+            stage_settings.index_interval = std::stoul(argv[++i]);
+        } else if (std::string(argv[i]) == "-s") {
+            stage_settings.virtual_split = std::string(argv[++i]) != "physical";
+        } else if (std::string(argv[i]) == "-k") {
+            std::string order = argv[++i];
+            stage_settings.sort_order = order == "key" ? SortOrder::Key
+                                      : order == "stable" ? SortOrder::StableKey : SortOrder::KeyValue;
+        } else if (std::string(argv[i]) == "-j") {
+            stage_settings.sort_threads = std::stoul(argv[++i]);
+        } else if (std::string(argv[i]) == "-f") {
+            stage_settings.merge_fan_in = std::stoul(argv[++i]);
+        } else if (std::string(argv[i]) == "-r") {
+            partitions = std::stoul(argv[++i]);
+        } else if (std::string(argv[i]) == "-c") {
+            std::string command = argv[++i];
+            if (command == "sum") {
+                combiner.function = SumCombine;
+            } else {
+                combiner.script_command = command;
+            }
+        } else if (std::string(argv[i]) == "-p") {
+            stage_settings.persistent_workers = true;
+        } else if (std::string(argv[i]) == "-m") {
+            stage_settings.streaming = std::string(argv[++i]) == "stream";
+        } else if (std::string(argv[i]) == "-H") {
+            stage_settings.hot_key_rows = std::stoul(argv[++i]);
+        } else if (std::string(argv[i]) == "-R") {
+            stage_settings.merge_ranges = std::stoul(argv[++i]);
+        } else if (std::string(argv[i]) == "-M") {
+            stage_settings.memory_budget = std::stoul(argv[++i]) << 20;
+        } else if (std::string(argv[i]) == "-e") {
+            std::string policy = argv[++i];
+            scheduling = policy == "fifo" ? SchedulingPolicy::Fifo
+                       : policy == "priority" ? SchedulingPolicy::Priority : SchedulingPolicy::WorkStealing;
+        } else if (std::string(argv[i]) == "-t") {
+            SetResourceLimits(limits, argv[++i]);
+        } else if (std::string(argv[i]) == "-o") {
+            binary_output = std::string(argv[++i]) == "binary";
         } else {
             pos_args.emplace_back(argv[i]);
         }
     }
 
-    auto executor = MakeThreadPoolExecutor(4);
+    if (pos_args[0] == "lookup") {
+        Lookup(pos_args[1], pos_args[2],
+               pos_args.size() > 3 ? std::make_optional(pos_args[3]) : std::nullopt);
+        return 0;
+    }
+
+    // Script input is fed through pipes; a script exiting early must surface
+    // as a write error instead of killing the whole job.
+    std::signal(SIGPIPE, SIG_IGN);
+
+    // Script tasks run on the subprocess workers, or on the cpu workers
+    // without them, and their scripts and persistent workers are limited to
+    // as many.
+    stage_settings.max_scripts = limits.subprocess > 0 ? limits.subprocess : limits.cpu;
+    GetWorkerPool().SetMaxWorkers(stage_settings.max_scripts);
+
+    auto start = std::chrono::steady_clock::now();
+    auto executor = MakeThreadPoolExecutor(limits, scheduling);
 
     TableFuturePtr result;
 
     if (pos_args[0] == "map") {
         result = Map(executor, DummyFuture(pos_args[1]),
-                     pos_args[3], false, block_size);
+                     FindMapper(pos_args[3]), false, block_size);
     } else if (pos_args[0] == "sort") {
         result = Sort(executor, DummyFuture(pos_args[1]),
                       false, block_size);
     } else if (pos_args[0] == "reduce") {
         result = Reduce(executor, DummyFuture(pos_args[1]),
-                        pos_args[3], false, block_size);
+                        FindReducer(pos_args[3]), false, block_size);
     } else if (pos_args[0] == "mapreduce") {
         result = MapReduce(executor, DummyFuture(pos_args[1]),
-                           pos_args[3], pos_args[4], false, block_size);
+                           FindMapper(pos_args[3]), FindReducer(pos_args[4]), false, block_size, partitions,
+                           combiner);
     }
 
-    bp::system("mv " + result->get() + " " + pos_args[2]);
+    std::string result_path;
+    std::chrono::duration<double> makespan;
+    try {
+        result_path = result->get();
+        makespan = std::chrono::steady_clock::now() - start;
+        MoveResult(result_path, pos_args[2], binary_output);
+    } catch (const std::exception& error) {
+        // Releasing the tasks removes their temporary tables.
+        executor->startShutdown();
+        executor->waitShutdown();
+        if (!result_path.empty()) {
+            unlink(result_path.c_str());
+        }
+        std::cerr << "Error: " << error.what() << "\n";
+        return 1;
+    }
+
+    // Finished tasks are released with the executor, removing their temporary tables.
+    executor->startShutdown();
+    executor->waitShutdown();
+
+    GetWorkerPool().Shutdown();
+    const auto& workers = GetWorkerPool().GetStats();
+    if (workers.spawns > 0) {
+        // Every chunk past the first of a worker would have started a process.
+        uint64_t saved_spawns = workers.chunks > workers.spawns ? workers.chunks - workers.spawns : 0;
+        std::cerr << "Persistent workers: " << workers.chunks << " chunks in " << workers.spawns
+                  << " processes (" << workers.restarts << " restarts), " << saved_spawns
+                  << " spawns saved, about " << saved_spawns * workers.spawn_nanoseconds / workers.spawns / 1000
+                  << " us of process startup\n";
+    }
+
+    const auto& key_groups = GetKeyGroupStats();
+    if (key_groups.largest_group > static_cast<uint64_t>(block_size)) {
+        std::cerr << "Skewed key groups: the largest has " << key_groups.largest_group << " of "
+                  << key_groups.rows << " rows";
+        if (key_groups.hot_groups > 0) {
+            std::cerr << ", " << key_groups.hot_groups << " hot keys were split";
+        }
+        std::cerr << "\n";
+    }
+
+    if (stage_settings.memory_budget > 0) {
+        std::cerr << "Memory budget: peak " << (GetMemoryBudget().GetPeakUsage() >> 20) << " of "
+                  << (stage_settings.memory_budget >> 20) << " MiB reserved\n";
+    }
+
+    std::cerr << "Makespan: " << makespan.count() * 1000 << " ms\n";
+
+    const auto& compression = GetCompressionStats();
+    if (compression.stored_bytes > 0) {
+        std::cerr << "Intermediate compression: " << compression.raw_bytes << " -> "
+                  << compression.stored_bytes << " bytes, ratio "
+                  << static_cast<double>(compression.raw_bytes) / compression.stored_bytes << "\n";
+    }
 
     return 0;
 }
@@ -1,12 +1,19 @@
+#include <cstdlib>
 #include <iostream>
 #include <sstream>
 
+// In persistent mode the input is a sequence of chunks, each ending with a
+// line holding only the record separator, which is echoed after the chunk.
 int main() {
-    std::string key;
-    std::string value;
-    while (std::getline(std::cin, key, '\t')) {
-        std::getline(std::cin, value);
-        std::istringstream values(value);
+    const std::string chunk_end("\x1e");
+    bool persistent = std::getenv("MAPREDUCE_PERSISTENT") != nullptr;
+    std::string row;
+    while (std::getline(std::cin, row)) {
+        if (persistent && row == chunk_end) {
+            std::cout << chunk_end << std::endl;
+            continue;
+        }
+        std::istringstream values(row.substr(row.find('\t') + 1));
         std::string name;
         while (values >> name) {
             std::cout << name << "\t1\n";
@@ -1,17 +1,309 @@
 #include "mapreduce.h"
+#include "worker_pool.h"
+#include <boost/filesystem.hpp>
+#include <charconv>
+#include <fcntl.h>
+#include <deque>
+#include <map>
+#include <sys/resource.h>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+const size_t max_merge_fan_in = 1024;
+const size_t min_run_bytes = 1 << 20;
+const size_t merge_source_bytes = 256 << 10;
+
+// Every core gets an equal share of the memory budget for its sort run.
+size_t GetRunBytes() {
+    return std::max<size_t>(stage_settings.memory_budget / std::max(std::thread::hardware_concurrency(), 1u),
+                            min_run_bytes);
+}
+
+// Every merge keeps its sources and result open, and several of them may
+// run at once, so only a quarter of the open files limit is used per merge.
+// Under a memory budget the block buffers of the sources have to fit into
+// the share of a sort run.
+size_t GetMergeFanIn() {
+    if (stage_settings.merge_fan_in > 0) {
+        return std::max<size_t>(stage_settings.merge_fan_in, 2);
+    }
+    size_t fan_in = max_merge_fan_in;
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        fan_in = std::clamp<size_t>(limit.rlim_cur / 4, 2, max_merge_fan_in);
+    }
+    if (stage_settings.memory_budget > 0) {
+        fan_in = std::clamp<size_t>(GetRunBytes() / merge_source_bytes, 2, fan_in);
+    }
+    return fan_in;
+}
+
+size_t GetMergeRanges() {
+    if (stage_settings.merge_ranges > 0) {
+        return stage_settings.merge_ranges;
+    }
+    return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+size_t GetMaxScripts() {
+    if (stage_settings.max_scripts > 0) {
+        return stage_settings.max_scripts;
+    }
+    return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+class MemoryReservation {
+public:
+    explicit MemoryReservation(size_t bytes) : bytes_(GetMemoryBudget().Acquire(bytes)) {
+    }
+
+    MemoryReservation(const MemoryReservation&) = delete;
+
+    MemoryReservation& operator=(const MemoryReservation&) = delete;
+
+    ~MemoryReservation() {
+        GetMemoryBudget().Release(bytes_);
+    }
+
+private:
+    const size_t bytes_;
+};
+
+// Holds the script slots of a task, starting with the one its first script
+// waits for.
+class ScriptReservation {
+public:
+    ScriptReservation() {
+        GetScriptSlots().Acquire();
+    }
+
+    ScriptReservation(const ScriptReservation&) = delete;
+
+    ScriptReservation& operator=(const ScriptReservation&) = delete;
+
+    ~ScriptReservation() {
+        GetScriptSlots().Release(slots_);
+    }
+
+    // Takes one more slot if another task doesn't need it.
+    bool TryAddSlot() {
+        if (!GetScriptSlots().TryAcquire()) {
+            return false;
+        }
+        ++slots_;
+        return true;
+    }
+
+    size_t GetSlots() const {
+        return slots_;
+    }
+
+private:
+    size_t slots_ = 1;
+};
+
+// Sorts the rows and writes them as a sorted table, combining the values of
+// every key if a combine function is given.
+void WriteSortedRun(RowStore& rows, const std::string& result_path, const CombineFunction& combine) {
+    rows.Sort(stage_settings.sort_order, stage_settings.sort_threads);
+
+    TableWriter result(result_path, stage_settings.sort);
+    if (stage_settings.index_interval > 0) {
+        result.EnableIndex(stage_settings.index_interval);
+    }
+    if (!combine) {
+        rows.Write(result);
+        result.Close();
+        return;
+    }
+    std::vector<std::string_view> values;
+    const auto& sorted_rows = rows.GetRows();
+    for (auto group = sorted_rows.begin(); group != sorted_rows.end();) {
+        auto key = rows.GetKey(*group);
+        values.clear();
+        auto row = group;
+        for (; row != sorted_rows.end() && rows.GetKey(*row) == key; ++row) {
+            values.push_back(rows.GetValue(*row));
+        }
+        result.Write(key, combine(key, values));
+        group = row;
+    }
+    result.Close();
+}
+
+// A script that crashed may have left truncated output behind, which must not
+// pass for a result, so the outputs of its task are removed.
+void CheckScriptExit(const std::string& script_command,
+                     int exit_code,
+                     const std::vector<std::string>& output_paths = {}) {
+    if (exit_code != 0) {
+        for (auto& path : output_paths) {
+            unlink(path.c_str());
+        }
+        throw std::runtime_error("Script " + script_command + " exited with code " + std::to_string(exit_code));
+    }
+}
+
+// Collects the values of consecutive rows with the same key and passes each
+// complete group to the reducer. Values are copied, since views into the
+// source rows may not outlive the next row.
+class KeyGroupReducer {
+public:
+    KeyGroupReducer(const ReduceFunction& reduce, Emit emit)
+        : reduce_(reduce), emit_(std::move(emit)) {
+    }
+
+    void Add(std::string_view key, std::string_view value) {
+        if (!value_ends_.empty() && key != key_) {
+            Flush();
+        }
+        if (value_ends_.empty()) {
+            key_.assign(key);
+        }
+        values_.append(value);
+        value_ends_.push_back(values_.size());
+    }
+
+    void Flush() {
+        if (value_ends_.empty()) {
+            return;
+        }
+        views_.clear();
+        size_t begin = 0;
+        for (size_t end : value_ends_) {
+            views_.emplace_back(values_.data() + begin, end - begin);
+            begin = end;
+        }
+        reduce_(key_, views_, emit_);
+        values_.clear();
+        value_ends_.clear();
+    }
+
+private:
+    const ReduceFunction& reduce_;
+    const Emit emit_;
+    std::string key_;
+    std::string values_;
+    std::vector<size_t> value_ends_;
+    std::vector<std::string_view> views_;
+};
+}
+
+std::string SumCombine(std::string_view key, const std::vector<std::string_view>& values) {
+    int64_t sum = 0;
+    for (auto value : values) {
+        int64_t number = 0;
+        auto result = std::from_chars(value.data(), value.data() + value.size(), number);
+        if (result.ec != std::errc() || result.ptr != value.data() + value.size()) {
+            throw std::runtime_error("Can't sum value " + std::string(value) + " of " + std::string(key));
+        }
+        sum += number;
+    }
+    return std::to_string(sum);
+}
+
+size_t MemoryBudget::Acquire(size_t bytes) {
+    size_t budget = stage_settings.memory_budget;
+    if (budget == 0) {
+        return 0;
+    }
+    bytes = std::min(bytes, budget);
+    std::unique_lock<std::mutex> lock(mutex_);
+    released_cv_.wait(lock, [&] { return used_ + bytes <= budget; });
+    used_ += bytes;
+    peak_ = std::max(peak_, used_);
+    return bytes;
+}
+
+void MemoryBudget::Release(size_t bytes) {
+    if (bytes == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    used_ -= bytes;
+    released_cv_.notify_all();
+}
+
+size_t MemoryBudget::GetPeakUsage() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return peak_;
+}
+
+MemoryBudget& GetMemoryBudget() {
+    static MemoryBudget budget;
+    return budget;
+}
+
+void ScriptSlots::Acquire() {
+    size_t max_scripts = GetMaxScripts();
+    std::unique_lock<std::mutex> lock(mutex_);
+    released_cv_.wait(lock, [&] { return used_ < max_scripts; });
+    ++used_;
+}
+
+bool ScriptSlots::TryAcquire() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (used_ >= GetMaxScripts()) {
+        return false;
+    }
+    ++used_;
+    return true;
+}
+
+void ScriptSlots::Release(size_t slots) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    used_ -= slots;
+    released_cv_.notify_all();
+}
+
+ScriptSlots& GetScriptSlots() {
+    static ScriptSlots slots;
+    return slots;
+}
+
+KeyGroupStats& GetKeyGroupStats() {
+    static KeyGroupStats stats;
+    return stats;
+}
 
 Concatenater::Concatenater(std::shared_ptr<Executor> executor,
                            std::vector<std::string> source_path,
                            bool remove_source)
     : ITableTask("concatenate", std::move(executor), std::move(source_path), remove_source) {
+    setResourceClass(ResourceClass::Io);
 }
 
 void Concatenater::run() {
     result_path_ = GetNewFileName();
-    TableWriter result(result_path_);
+    std::vector<TableFormat> formats;
+    for (const auto& source_path : source_path_) {
+        formats.push_back(DetectTableFormat(source_path));
+    }
+    auto format = formats.empty() ? TableFormat::Binary : formats.front();
+    for (auto source_format : formats) {
+        if (source_format == TableFormat::Text) {
+            format = TableFormat::Text;
+            break;
+        }
+        if (source_format != format) {
+            format = TableFormat::Binary;
+        }
+    }
+    TableWriter result(result_path_, format);
+    // Concatenated ranges of a sorted table keep their index.
+    bool indexed = format != TableFormat::Text && !source_path_.empty();
+    for (size_t i = 0; i < source_path_.size() && indexed; ++i) {
+        indexed = TableReader(source_path_[i]).IsIndexed();
+    }
+    if (indexed) {
+        result.EnableIndex(stage_settings.index_interval > 0 ? stage_settings.index_interval
+                                                              : default_index_interval);
+    }
     for (const auto& source_path : source_path_) {
-        result.Append(source_path);
+        result.AppendTable(source_path);
     }
+    result.Close();
 }
 
 Performer::Performer(std::shared_ptr<Executor> executor,
@@ -20,103 +312,679 @@ Performer::Performer(std::shared_ptr<Executor> executor,
                      bool remove_source)
     : ITableTask("perform", std::move(executor), std::move(source_path), remove_source),
       script_command_(std::move(script_command)) {
+    setResourceClass(ResourceClass::Subprocess);
 }
 
 void Performer::run() {
     result_path_ = GetNewFileName();
-    bp::system(script_command_, bp::std_out > result_path_, bp::std_in < source_path_);
+    ScriptReservation reservation;
+    if (stage_settings.persistent_workers) {
+        try {
+            GetWorkerPool().Perform(script_command_, source_path_, result_path_);
+        } catch (...) {
+            unlink(result_path_.c_str());
+            throw;
+        }
+        return;
+    }
+    TableReader source(source_path_);
+    if (source.GetFormat() == TableFormat::Text && !ParseTableSlice(source_path_).has_value()) {
+        CheckScriptExit(script_command_,
+                        bp::system(script_command_, bp::std_out > result_path_, bp::std_in < source_path_),
+                        {result_path_});
+        return;
+    }
+
+    // Scripts only speak text, so binary chunks are decoded and slices are
+    // cut out of their files into a pipe.
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        throw std::runtime_error("Can't create pipe for " + script_command_);
+    }
+    bp::pipe script_input(fds[0], fds[1]);
+    bp::child script(script_command_, bp::std_out > result_path_, bp::std_in < script_input);
+    int input_fd = fcntl(fds[1], F_DUPFD_CLOEXEC, 0);
+    script_input.close();
+    {
+        TableWriter input(input_fd);
+        input.Append(source);
+    }
+    script.wait();
+    CheckScriptExit(script_command_, script.exit_code(), {result_path_});
+}
+
+NativeMapper::NativeMapper(ExecutorPtr executor,
+                           std::string source_path,
+                           MapFunction function,
+                           bool remove_source)
+    : ITableTask("native_map", std::move(executor), std::move(source_path), remove_source),
+      function_(std::move(function)) {
+}
+
+void NativeMapper::run() {
+    result_path_ = GetNewFileName();
+    TableWriter result(result_path_, stage_settings.split);
+    Emit emit = [&result](std::string_view key, std::string_view value) {
+        result.Write(key, value);
+    };
+    TableReader source(source_path_);
+    for (; !source.Empty(); source.Next()) {
+        function_(source.GetKeyView(), source.GetValueView(), emit);
+    }
+    result.Close();
+}
+
+NativeReducer::NativeReducer(ExecutorPtr executor,
+                             std::string source_path,
+                             ReduceFunction function,
+                             bool remove_source)
+    : ITableTask("native_reduce", std::move(executor), std::move(source_path), remove_source),
+      function_(std::move(function)) {
+}
+
+void NativeReducer::run() {
+    result_path_ = GetNewFileName();
+    TableWriter result(result_path_, stage_settings.split);
+    KeyGroupReducer groups(function_, [&result](std::string_view key, std::string_view value) {
+        result.Write(key, value);
+    });
+    TableReader source(source_path_);
+    for (; !source.Empty(); source.Next()) {
+        groups.Add(source.GetKeyView(), source.GetValueView());
+    }
+    groups.Flush();
+    result.Close();
 }
 
 Splitter::Splitter(ExecutorPtr executor,
                    std::string source_path,
                    bool remove_source,
                    size_t block_size,
-                   bool by_key)
+                   bool by_key,
+                   size_t max_chunk_bytes,
+                   std::shared_ptr<HotKeys> hot_keys)
     : ITableTask("split", std::move(executor), std::move(source_path), remove_source),
-      block_size_(block_size), by_key_(by_key) {
+      block_size_(block_size), by_key_(by_key), max_chunk_bytes_(max_chunk_bytes), hot_keys_(std::move(hot_keys)) {
+    setResourceClass(ResourceClass::Io);
+}
+
+bool Splitter::CountKeyRow(std::string_view key, size_t count) {
+    bool new_group = group_rows_ == 0 || key != group_key_;
+    if (new_group) {
+        FinishKeyGroup();
+        group_key_.assign(key);
+    }
+    bool hot = hot_keys_ && stage_settings.hot_key_rows > 0 && group_rows_ >= stage_settings.hot_key_rows;
+    bool ends_chunk = count >= block_size_ && (new_group || hot);
+    if (ends_chunk && !new_group && (hot_keys_->keys.empty() || hot_keys_->keys.back() != key)) {
+        hot_keys_->keys.emplace_back(key);
+        ++GetKeyGroupStats().hot_groups;
+    }
+    ++group_rows_;
+    return ends_chunk;
+}
+
+void Splitter::FinishKeyGroup() {
+    if (group_rows_ == 0) {
+        return;
+    }
+    auto& stats = GetKeyGroupStats();
+    ++stats.groups;
+    stats.rows += group_rows_;
+    uint64_t largest = stats.largest_group;
+    while (largest < group_rows_ && !stats.largest_group.compare_exchange_weak(largest, group_rows_)) {
+    }
+    group_rows_ = 0;
 }
 
 void Splitter::run() {
     TableReader source(source_path_);
+    if (by_key_ && !source.Empty()) {
+        // Every later row is counted when it is checked for a chunk end.
+        CountKeyRow(source.GetKeyView(), 0);
+    }
+    if (!stage_settings.virtual_split || !SplitVirtually(source)) {
+        SplitPhysically(source);
+    }
+    FinishKeyGroup();
+}
+
+void Splitter::SplitPhysically(TableReader& source) {
     while (!source.Empty()) {
         std::string chunk_name = GetNewFileName();
-        TableWriter chunk(chunk_name);
+        TableWriter chunk(chunk_name, stage_settings.split);
 
         if (by_key_) {
-            chunk.WriteKeyBlock(source);
+            size_t count = 0;
+            do {
+                chunk.Write(source.GetKeyView(), source.GetValueView());
+            } while (source.Next() && !CountKeyRow(source.GetKeyView(), ++count));
+        } else if (max_chunk_bytes_ > 0) {
+            size_t count = 0;
+            size_t bytes = 0;
+            do {
+                chunk.Write(source.GetKeyView(), source.GetValueView());
+                bytes += RowStore::GetRowMemory(source.GetKeyView().size(), source.GetValueView().size());
+            } while (source.Next() && ++count < block_size_ && bytes < max_chunk_bytes_);
         } else {
             chunk.Append(source, block_size_);
         }
+        chunk.Close();
 
         result_path_.push_back(chunk_name);
     }
 }
 
+// Every slice refers to its own hard link of the source file, so consumers
+// can remove their slices independently of each other and of the source.
+bool Splitter::SplitVirtually(TableReader& source) {
+    if (!source.IsMapped()) {
+        return false;
+    }
+    std::string source_file = GetTableFile(source_path_);
+    while (!source.Empty()) {
+        std::string chunk_name = GetNewFileName();
+        // A file left by an earlier job under the same name is stale.
+        unlink(chunk_name.c_str());
+        if (link(source_file.c_str(), chunk_name.c_str()) != 0) {
+            if (result_path_.empty()) {
+                return false;
+            }
+            throw std::runtime_error("Can't link " + source_file + " to " + chunk_name);
+        }
+        uint64_t begin = source.GetRowOffset();
+        if (by_key_) {
+            size_t count = 0;
+            while (source.Next() && !CountKeyRow(source.GetKeyView(), ++count)) {
+            }
+        } else {
+            // Chunk bytes are counted as the memory the rows take in a sort.
+            size_t max_bytes = max_chunk_bytes_ > 0 ? max_chunk_bytes_ : std::numeric_limits<size_t>::max();
+            size_t count = 0;
+            size_t bytes = 0;
+            do {
+                bytes += RowStore::GetRowMemory(source.GetKeyView().size(), source.GetValueView().size());
+            } while (source.Next() && ++count < block_size_ && bytes < max_bytes);
+        }
+        result_path_.push_back(FormatTableSlice({chunk_name, begin, source.GetRowOffset()}));
+    }
+    return true;
+}
+
 NaiveSorter::NaiveSorter(ExecutorPtr executor,
                          std::string source_path,
-                         bool remove_source)
-    : ITableTask("naive_sort", std::move(executor), std::move(source_path), remove_source) {
+                         bool remove_source,
+                         CombineFunction combine)
+    : ITableTask("naive_sort", std::move(executor), std::move(source_path), remove_source),
+      combine_(std::move(combine)) {
 }
 
 void NaiveSorter::run() {
-    auto items = TableReader(source_path_).ReadAllItems();
-
-    std::sort(items.begin(), items.end());
+    MemoryReservation reservation(GetRunBytes());
+    RowStore rows;
+    {
+        // Row bytes take about as much space as the uncompressed source.
+        auto slice = ParseTableSlice(source_path_);
+        rows.Reserve(0, slice.has_value() ? slice->end - slice->begin
+                                          : boost::filesystem::file_size(source_path_));
+        TableReader source(source_path_);
+        rows.Append(source);
+    }
 
     result_path_ = GetNewFileName();
-    TableWriter result(result_path_);
-    result.Write(items);
+    WriteSortedRun(rows, result_path_, combine_);
+}
+
+MapSorter::MapSorter(ExecutorPtr executor,
+                     std::string source_path,
+                     Mapper mapper,
+                     bool remove_source,
+                     size_t block_size,
+                     CombineFunction combine)
+    : ITableTask("map_sort", std::move(executor), std::move(source_path), remove_source),
+      mapper_(std::move(mapper)), block_size_(block_size), combine_(std::move(combine)) {
+    setResourceClass(mapper_.function ? ResourceClass::Cpu : ResourceClass::Subprocess);
+}
+
+void MapSorter::run() {
+    if (!mapper_.function) {
+        RunScript();
+        return;
+    }
+    MemoryReservation reservation(GetRunBytes());
+    RowStore rows;
+    Emit emit = [&rows](std::string_view key, std::string_view value) {
+        rows.Add(key, value);
+    };
+    TableReader source(source_path_);
+    for (; !source.Empty(); source.Next()) {
+        mapper_.function(source.GetKeyView(), source.GetValueView(), emit);
+        if (IsRunFull(rows)) {
+            AddRun(rows);
+        }
+    }
+    if (rows.Size() > 0) {
+        AddRun(rows);
+    }
+}
+
+bool MapSorter::IsRunFull(const RowStore& rows) const {
+    if (stage_settings.memory_budget > 0) {
+        return rows.GetMemoryUsage() + rows.Size() * sizeof(RowStore::Row) >= GetRunBytes();
+    }
+    return rows.Size() >= block_size_;
+}
+
+void MapSorter::AddRun(RowStore& rows) {
+    result_path_.push_back(GetNewFileName());
+    WriteSortedRun(rows, result_path_.back(), combine_);
+    rows = RowStore();
+}
+
+void MapSorter::RunScript() {
+    ScriptReservation reservation;
+    int input[2];
+    int output[2];
+    if (pipe2(input, O_CLOEXEC) != 0) {
+        throw std::runtime_error("Can't create pipe for " + mapper_.script_command);
+    }
+    if (pipe2(output, O_CLOEXEC) != 0) {
+        close(input[0]);
+        close(input[1]);
+        throw std::runtime_error("Can't create pipe for " + mapper_.script_command);
+    }
+    bp::pipe script_input(input[0], input[1]);
+    bp::pipe script_output(output[0], output[1]);
+    bp::child script(mapper_.script_command, bp::std_out > script_output, bp::std_in < script_input);
+    int input_fd = fcntl(input[1], F_DUPFD_CLOEXEC, 0);
+    int output_fd = fcntl(output[0], F_DUPFD_CLOEXEC, 0);
+    script_input.close();
+    script_output.close();
+
+    // The input is fed by another thread, so neither pipe can fill up while
+    // this one waits for the other.
+    std::exception_ptr input_error;
+    std::thread feeder([this, input_fd, &input_error] {
+        try {
+            TableWriter input(input_fd);
+            input.Append(source_path_);
+        } catch (...) {
+            input_error = std::current_exception();
+        }
+    });
+    try {
+        MemoryReservation reservation(GetRunBytes());
+        TableReader output("/dev/fd/" + std::to_string(output_fd), ReadMode::Stream);
+        RowStore rows;
+        for (; !output.Empty(); output.Next()) {
+            rows.Add(output.GetKeyView(), output.GetValueView());
+            if (IsRunFull(rows)) {
+                AddRun(rows);
+            }
+        }
+        if (rows.Size() > 0) {
+            AddRun(rows);
+        }
+    } catch (...) {
+        close(output_fd);
+        script.terminate();
+        feeder.join();
+        throw;
+    }
+    close(output_fd);
+    feeder.join();
+    script.wait();
+    CheckScriptExit(mapper_.script_command, script.exit_code(), result_path_);
+    if (input_error) {
+        std::rethrow_exception(input_error);
+    }
+}
+
+Partitioner::Partitioner(ExecutorPtr executor,
+                         std::string source_path,
+                         size_t partitions,
+                         bool remove_source)
+    : ITableTask("partition", std::move(executor), std::move(source_path), remove_source),
+      partitions_(partitions) {
+    if (partitions_ == 0) {
+        throw std::runtime_error("Nothing to partition into");
+    }
+    setResourceClass(ResourceClass::Io);
+}
+
+void Partitioner::run() {
+    // All partitions are written at once, so they share one buffer's worth of memory.
+    size_t buffer_size = std::max<size_t>(default_write_buffer_size / partitions_, 64 << 10);
+    std::vector<std::unique_ptr<TableWriter>> partitions;
+    for (size_t partition = 0; partition < partitions_; ++partition) {
+        result_path_.push_back(GetNewFileName());
+        partitions.push_back(std::make_unique<TableWriter>(result_path_.back(), stage_settings.split, buffer_size));
+    }
+    std::hash<std::string_view> hash;
+    TableReader source(source_path_);
+    for (; !source.Empty(); source.Next()) {
+        auto key = source.GetKeyView();
+        partitions[hash(key) % partitions_]->Write(key, source.GetValueView());
+    }
+    for (auto& partition : partitions) {
+        partition->Close();
+    }
 }
 
 Merger::Merger(ExecutorPtr executor,
-               std::vector<std::string> source_path,
-               bool remove_sources)
-    : ITableTask("merge", std::move(executor), std::move(source_path), remove_sources) {
-    if(source_path_.size() != 2) {
-        throw std::runtime_error("Merge accept exactly 2 tables");
+               std::vector<std::string> source_paths,
+               bool remove_sources,
+               KeyRange range)
+    : ITableTask("merge", std::move(executor), std::move(source_paths), remove_sources),
+      range_(std::move(range)) {
+    if (source_path_.empty()) {
+        throw std::runtime_error("Nothing to merge");
     }
+    setResourceClass(ResourceClass::Io);
 }
 
 void Merger::run() {
+    MemoryReservation reservation(source_path_.size() * merge_source_bytes);
     result_path_ = GetNewFileName();
-    TableReader first_source(source_path_[0]);
-    TableReader second_source(source_path_[1]);
-    TableWriter result(result_path_);
-    while (!first_source.Empty() || !second_source.Empty()) {
-        if (second_source.Empty() || (!first_source.Empty() && first_source.GetKey() < second_source.GetKey())) {
-            result.Write(first_source.GetItem());
-            first_source.Next();
-        } else {
-            result.Write(second_source.GetItem());
-            second_source.Next();
+    std::vector<std::unique_ptr<TableReader>> sources;
+    for (const auto& source_path : source_path_) {
+        sources.push_back(std::make_unique<TableReader>(source_path));
+        if (range_.last.has_value()) {
+            sources.back()->SetUpperBound(range_.last.value());
         }
+        if (range_.first.has_value()) {
+            sources.back()->Seek(range_.first.value());
+        }
+    }
+    MergingReader merged(std::move(sources));
+    TableWriter result(result_path_, stage_settings.merge);
+    if (stage_settings.index_interval > 0) {
+        result.EnableIndex(stage_settings.index_interval);
+    }
+    for (; !merged.Empty(); merged.Next()) {
+        auto& source = merged.Current();
+        result.Write(source.GetKeyView(), source.GetValueView());
+    }
+    result.Close();
+}
+
+MergeReducer::MergeReducer(ExecutorPtr executor,
+                           std::vector<std::string> source_paths,
+                           Reducer reducer,
+                           bool remove_source,
+                           size_t block_size)
+    : ITableTask("merge_reduce", std::move(executor), std::move(source_paths), remove_source),
+      reducer_(std::move(reducer)), block_size_(block_size) {
+    setResourceClass(reducer_.function ? ResourceClass::Cpu : ResourceClass::Subprocess);
+}
+
+void MergeReducer::run() {
+    MemoryReservation reservation(source_path_.size() * merge_source_bytes);
+    std::vector<std::unique_ptr<TableReader>> sources;
+    for (const auto& source_path : source_path_) {
+        sources.push_back(std::make_unique<TableReader>(source_path));
+    }
+    MergingReader merged(std::move(sources));
+    if (!reducer_.function) {
+        RunScripts(merged);
+        return;
+    }
+    result_path_.push_back(GetNewFileName());
+    TableWriter result(result_path_.back(), stage_settings.split);
+    KeyGroupReducer groups(reducer_.function, [&result](std::string_view key, std::string_view value) {
+        result.Write(key, value);
+    });
+    for (; !merged.Empty(); merged.Next()) {
+        auto& source = merged.Current();
+        groups.Add(source.GetKeyView(), source.GetValueView());
+    }
+    groups.Flush();
+    result.Close();
+}
+
+void MergeReducer::RunScripts(MergingReader& merged) {
+    // Scripts work on earlier chunks while later ones are being merged, as
+    // far as other tasks leave script slots free.
+    ScriptReservation reservation;
+    std::deque<bp::child> scripts;
+    std::string key;
+    while (!merged.Empty()) {
+        if (scripts.size() >= reservation.GetSlots() && !reservation.TryAddSlot()) {
+            scripts.front().wait();
+            CheckScriptExit(reducer_.script_command, scripts.front().exit_code(), result_path_);
+            scripts.pop_front();
+        }
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0) {
+            throw std::runtime_error("Can't create pipe for " + reducer_.script_command);
+        }
+        bp::pipe script_input(fds[0], fds[1]);
+        result_path_.push_back(GetNewFileName());
+        scripts.emplace_back(reducer_.script_command, bp::std_out > result_path_.back(), bp::std_in < script_input);
+        TableWriter input(fcntl(fds[1], F_DUPFD_CLOEXEC, 0));
+        script_input.close();
+
+        for (size_t count = 0; !merged.Empty(); merged.Next(), ++count) {
+            auto& source = merged.Current();
+            if (source.GetKeyView() != key) {
+                if (count >= block_size_) {
+                    break;
+                }
+                key = source.GetKeyView();
+            }
+            input.Write(source.GetKeyView(), source.GetValueView());
+        }
+    }
+    for (auto& script : scripts) {
+        script.wait();
+        CheckScriptExit(reducer_.script_command, script.exit_code(), result_path_);
     }
 }
 
 ListMerger::ListMerger(ExecutorPtr executor,
                        std::vector<std::string> source_paths,
                        bool remove_source)
-    : ITableTask("list_merge", std::move(executor), std::move(source_paths), remove_source) {
+    : ITableTask("list_merge", std::move(executor), std::move(source_paths)),
+      remove_sources_(remove_source) {
 }
 
 void ListMerger::run() {
+    if (source_path_.empty()) {
+        std::string empty_path = GetNewFileName();
+        TableWriter(empty_path, stage_settings.merge).Close();
+        result_path_ = DummyFuture(empty_path);
+        return;
+    }
+    if (source_path_.size() == 1) {
+        if (remove_sources_) {
+            result_path_ = DummyFuture(source_path_[0]);
+            return;
+        }
+        std::string link_path = GetNewFileName();
+        unlink(link_path.c_str());
+        if (link(GetTableFile(source_path_[0]).c_str(), link_path.c_str()) != 0) {
+            throw std::runtime_error("Can't link " + source_path_[0]);
+        }
+        // A slice keeps its bounds, only its file is linked.
+        auto slice = ParseTableSlice(source_path_[0]);
+        result_path_ = DummyFuture(slice.has_value()
+                                   ? FormatTableSlice({link_path, slice->begin, slice->end})
+                                   : link_path);
+        return;
+    }
+
+    size_t fan_in = GetMergeFanIn();
+    size_t ranges = GetMergeRanges();
+    std::vector<TableFuturePtr> level;
     for (const auto& source_path : source_path_) {
-        source_links_.push_back(GetNewFileName());
-        bp::system("ln " + source_path + " " + source_links_.back());
+        level.push_back(DummyFuture(source_path));
+    }
+    bool remove_source = remove_sources_;
+    while (level.size() > 1) {
+        if (level.size() <= fan_in && ranges > 1) {
+            auto double_future = Run<RangeMerger, TableFuturePtr>(executor_, executor_->whenAll(level), ranges,
+                                                                  remove_source);
+            result_path_ = executor_->redirect(double_future);
+            return;
+        }
+        size_t groups = (level.size() + fan_in - 1) / fan_in;
+        std::vector<TableFuturePtr> next_level;
+        for (size_t group = 0; group < groups; ++group) {
+            std::vector<TableFuturePtr> sources(level.begin() + level.size() * group / groups,
+                                                level.begin() + level.size() * (group + 1) / groups);
+            next_level.push_back(
+                Run<Merger, std::string>(executor_, executor_->whenAll(sources), remove_source));
+        }
+        level = std::move(next_level);
+        remove_source = true;
+    }
+    result_path_ = level[0];
+}
+
+HotKeyCombiner::HotKeyCombiner(ExecutorPtr executor,
+                               std::string source_path,
+                               Reducer reducer,
+                               std::shared_ptr<HotKeys> hot_keys)
+    : ITableTask("hot_key_combine", std::move(executor), std::move(source_path)),
+      reducer_(std::move(reducer)), hot_keys_(std::move(hot_keys)) {
+    setResourceClass(reducer_.function ? ResourceClass::Cpu : ResourceClass::Subprocess);
+}
+
+// Reducers may write their keys in any order, so the partial results of the
+// hot keys are collected first. The result of a hot key takes the place of
+// its first partial one.
+void HotKeyCombiner::run() {
+    const auto& hot_keys = hot_keys_->keys;
+    if (hot_keys.empty()) {
+        result_path_ = source_path_;
+        return;
+    }
+    std::map<std::string, std::vector<TableItem>, std::less<>> partials;
+    for (const auto& hot_key : hot_keys) {
+        partials[hot_key];
     }
-    result_path_ = RecursiveMerge(0, source_links_.size());
+    for (TableReader source(source_path_); !source.Empty(); source.Next()) {
+        auto partial = partials.find(source.GetKeyView());
+        if (partial != partials.end()) {
+            partial->second.push_back(source.GetItem());
+        }
+    }
+    result_path_ = GetNewFileName();
+    {
+        TableReader source(source_path_);
+        TableWriter result(result_path_, source.GetFormat());
+        for (; !source.Empty(); source.Next()) {
+            auto partial = partials.find(source.GetKeyView());
+            if (partial == partials.end()) {
+                if (source.IsMapped()) {
+                    result.WriteRaw(source.GetRawRow());
+                } else {
+                    result.Write(source.GetKeyView(), source.GetValueView());
+                }
+                continue;
+            }
+            if (partial->second.empty()) {
+                continue;
+            }
+            if (reducer_.function) {
+                std::vector<std::string_view> values;
+                for (const auto& item : partial->second) {
+                    values.push_back(item.second);
+                }
+                reducer_.function(partial->first, values, [&result](std::string_view key, std::string_view value) {
+                    result.Write(key, value);
+                });
+            } else {
+                ReduceScript(partial->second, result);
+            }
+            partial->second.clear();
+        }
+        result.Close();
+    }
+    unlink(GetTableFile(source_path_).c_str());
 }
 
-TableFuturePtr ListMerger::RecursiveMerge(size_t begin, size_t end) {
-    if (begin + 1 == end) {
-        return DummyFuture(source_links_[begin]);
+void HotKeyCombiner::ReduceScript(const std::vector<TableItem>& rows, TableWriter& result) {
+    std::string input_path = GetNewFileName();
+    std::string output_path = GetNewFileName();
+    {
+        TableWriter input(input_path);
+        input.Write(rows);
+        input.Close();
+    }
+    ScriptReservation reservation;
+    if (stage_settings.persistent_workers) {
+        try {
+            GetWorkerPool().Perform(reducer_.script_command, input_path, output_path);
+        } catch (...) {
+            unlink(input_path.c_str());
+            unlink(output_path.c_str());
+            throw;
+        }
+    } else {
+        CheckScriptExit(reducer_.script_command,
+                        bp::system(reducer_.script_command, bp::std_out > output_path, bp::std_in < input_path),
+                        {input_path, output_path});
     }
+    result.Append(output_path);
+    unlink(input_path.c_str());
+    unlink(output_path.c_str());
+}
 
-    size_t mid = begin + (end - begin) / 2;
-    auto left = RecursiveMerge(begin, mid);
-    auto right = RecursiveMerge(mid, end);
+RangeMerger::RangeMerger(ExecutorPtr executor,
+                         std::vector<std::string> source_paths,
+                         size_t ranges,
+                         bool remove_source)
+    : ITableTask("range_merge", std::move(executor), std::move(source_paths)),
+      ranges_(ranges), remove_sources_(remove_source) {
+}
+
+void RangeMerger::run() {
+    // Index entries are taken every index interval rows, so their keys are an
+    // evenly spaced sample of the rows that costs no extra pass.
+    std::vector<std::string> samples;
+    for (const auto& source_path : source_path_) {
+        TableReader source(source_path);
+        for (const auto& entry : source.GetIndex()) {
+            samples.push_back(entry.key);
+        }
+    }
+    std::sort(samples.begin(), samples.end());
+    std::vector<std::string> splitters;
+    for (size_t range = 1; range < ranges_ && !samples.empty(); ++range) {
+        const auto& key = samples[samples.size() * range / ranges_];
+        if (key != samples.front() && (splitters.empty() || splitters.back() != key)) {
+            splitters.push_back(key);
+        }
+    }
 
-    return Merge(executor_, left, right, true);
+    auto source_paths = DummyFuture(source_path_);
+    if (splitters.empty()) {
+        result_path_ = Run<Merger, std::string>(executor_, source_paths, remove_sources_);
+        return;
+    }
+    std::vector<TableFuturePtr> range_paths;
+    for (size_t range = 0; range <= splitters.size(); ++range) {
+        KeyRange key_range;
+        if (range > 0) {
+            key_range.first = splitters[range - 1];
+        }
+        if (range < splitters.size()) {
+            key_range.last = splitters[range];
+        }
+        range_paths.push_back(Run<Merger, std::string>(executor_, source_paths, false, std::move(key_range)));
+    }
+    auto merged_ranges = executor_->whenAll(range_paths);
+    if (remove_sources_) {
+        merged_ranges = executor_->then<std::vector<std::string>>(
+            merged_ranges, [merged_ranges, sources = source_path_] {
+                for (const auto& source : sources) {
+                    unlink(GetTableFile(source).c_str());
+                }
+                return merged_ranges->get();
+            });
+    }
+    result_path_ = Concatenate(executor_, merged_ranges, true);
 }
 
 TableFuturePtr Concatenate(ExecutorPtr executor,
@@ -145,31 +1013,59 @@ MultiTableFuturePtr Split(ExecutorPtr executor,
                           TableFuturePtr source_path,
                           bool remove_source,
                           size_t block_size,
-                          bool by_key) {
+                          bool by_key,
+                          size_t max_chunk_bytes) {
     return Run<Splitter, std::vector<std::string>>(std::move(executor), std::move(source_path), remove_source,
-                                                   block_size, by_key);
+                                                   block_size, by_key, max_chunk_bytes);
 }
 
 TableFuturePtr Map(ExecutorPtr executor,
                    TableFuturePtr source_path,
-                   std::string script_command,
+                   Mapper mapper,
                    bool remove_source,
                    size_t block_size) {
     auto split_result = Split(executor, std::move(source_path), remove_source, block_size);
-    auto perform_result = Perform(executor, split_result, std::move(script_command), true);
-    return Concatenate(executor, perform_result, true);
+    auto map_result = Map(executor, split_result, std::move(mapper), true);
+    return Concatenate(executor, map_result, true);
+}
+
+MultiTableFuturePtr Map(ExecutorPtr executor,
+                        MultiTableFuturePtr source_paths,
+                        Mapper mapper,
+                        bool remove_source) {
+    if (mapper.function) {
+        return RunForAll<NativeMapper, std::string>(std::move(executor), std::move(source_paths),
+                                                    std::move(mapper.function), remove_source);
+    }
+    return Perform(std::move(executor), std::move(source_paths), std::move(mapper.script_command), remove_source);
 }
 
 TableFuturePtr NaiveSort(ExecutorPtr executor,
                          TableFuturePtr source_path,
-                         bool remove_source) {
-    return Run<NaiveSorter, std::string>(std::move(executor), std::move(source_path), remove_source);
+                         bool remove_source,
+                         CombineFunction combine) {
+    return Run<NaiveSorter, std::string>(std::move(executor), std::move(source_path), remove_source,
+                                         std::move(combine));
 }
 
 MultiTableFuturePtr NaiveSort(ExecutorPtr executor,
                               MultiTableFuturePtr source_paths,
-                              bool remove_source) {
-    return RunForAll<NaiveSorter, std::string>(std::move(executor), std::move(source_paths), remove_source);
+                              bool remove_source,
+                              CombineFunction combine) {
+    return RunForAll<NaiveSorter, std::string>(std::move(executor), std::move(source_paths), remove_source,
+                                               std::move(combine));
+}
+
+// Script output is sorted again, natively combined rows come out sorted.
+MultiTableFuturePtr Combine(ExecutorPtr executor,
+                            MultiTableFuturePtr source_paths,
+                            const Combiner& combiner,
+                            bool remove_source) {
+    if (!combiner.script_command.empty()) {
+        auto perform_result = Perform(executor, std::move(source_paths), combiner.script_command, remove_source);
+        return NaiveSort(executor, std::move(perform_result), true, combiner.function);
+    }
+    return NaiveSort(executor, std::move(source_paths), remove_source, combiner.function);
 }
 
 TableFuturePtr Merge(ExecutorPtr executor,
@@ -187,32 +1083,161 @@ TableFuturePtr Merge(ExecutorPtr executor,
     return executor->redirect(double_future);
 }
 
+namespace {
+// Native combiners run as part of the chunk sort, scripts on its result.
+TableFuturePtr SortChunks(ExecutorPtr executor, MultiTableFuturePtr chunk_paths, const Combiner& combiner) {
+    auto naive_sort_result = combiner.script_command.empty()
+        ? NaiveSort(executor, std::move(chunk_paths), true, combiner.function)
+        : Combine(executor, NaiveSort(executor, std::move(chunk_paths), true), combiner, true);
+    return Merge(executor, naive_sort_result, true);
+}
+
+// Under a memory budget runs are cut by their memory instead of their rows.
+size_t GetRunRows(size_t block_size) {
+    return stage_settings.memory_budget > 0 ? std::numeric_limits<size_t>::max() : block_size;
+}
+
+size_t GetMaxRunBytes() {
+    return stage_settings.memory_budget > 0 ? GetRunBytes() : 0;
+}
+}
+
 TableFuturePtr Sort(ExecutorPtr executor,
                     TableFuturePtr source_path,
                     bool remove_source,
-                    size_t block_size) {
-    auto split_result = Split(executor, std::move(source_path), remove_source, block_size);
-    auto naive_sort_result = NaiveSort(executor, std::move(split_result), true);
-    return Merge(executor, naive_sort_result, true);
+                    size_t block_size,
+                    const Combiner& combiner) {
+    auto split_result = Split(executor, std::move(source_path), remove_source, GetRunRows(block_size), false,
+                              GetMaxRunBytes());
+    return SortChunks(std::move(executor), std::move(split_result), combiner);
+}
+
+TableFuturePtr Sort(ExecutorPtr executor,
+                    MultiTableFuturePtr source_paths,
+                    bool remove_source,
+                    size_t block_size,
+                    const Combiner& combiner) {
+    auto split_results = RunForAll<Splitter, std::vector<std::string>>(executor, std::move(source_paths),
+                                                                       remove_source, GetRunRows(block_size), false,
+                                                                       GetMaxRunBytes());
+    auto split_result = executor->then<std::vector<std::string>>(split_results, [split_results] {
+        std::vector<std::string> chunks;
+        for (const auto& source_chunks : split_results->get()) {
+            chunks.insert(chunks.end(), source_chunks.begin(), source_chunks.end());
+        }
+        return chunks;
+    }, true);
+    return SortChunks(std::move(executor), std::move(split_result), combiner);
+}
+
+MultiTableFuturePtr MapSort(ExecutorPtr executor,
+                            MultiTableFuturePtr source_paths,
+                            Mapper mapper,
+                            bool remove_source,
+                            size_t block_size,
+                            CombineFunction combine) {
+    auto sort_results = RunForAll<MapSorter, std::vector<std::string>>(executor, std::move(source_paths),
+                                                                       std::move(mapper), remove_source,
+                                                                       block_size, std::move(combine));
+    return executor->then<std::vector<std::string>>(sort_results, [sort_results] {
+        std::vector<std::string> runs;
+        for (const auto& source_runs : sort_results->get()) {
+            runs.insert(runs.end(), source_runs.begin(), source_runs.end());
+        }
+        return runs;
+    }, true);
+}
+
+// Runs that don't fit into one merge are merged into a table first. An empty
+// input has no runs and reduces to no tables.
+MultiTableFuturePtr MergeReduce(ExecutorPtr executor,
+                                MultiTableFuturePtr source_paths,
+                                Reducer reducer,
+                                bool remove_source,
+                                size_t block_size) {
+    auto double_future = executor->then<MultiTableFuturePtr>(source_paths, [=] {
+        if (source_paths->get().empty()) {
+            return DummyFuture(std::vector<std::string>());
+        }
+        if (source_paths->get().size() <= GetMergeFanIn()) {
+            return Run<MergeReducer, std::vector<std::string>>(executor, source_paths, reducer,
+                                                               remove_source, block_size);
+        }
+        auto merge_result = Merge(executor, source_paths, remove_source);
+        return Run<MergeReducer, std::vector<std::string>>(executor, executor->whenAll(std::vector{merge_result}),
+                                                           reducer, true, block_size);
+    }, true);
+    return executor->redirect(double_future);
+}
+
+FuturePtr<std::vector<std::vector<std::string>>> Partition(ExecutorPtr executor,
+                                                           MultiTableFuturePtr source_paths,
+                                                           size_t partitions,
+                                                           bool remove_source) {
+    return RunForAll<Partitioner, std::vector<std::string>>(std::move(executor), std::move(source_paths),
+                                                            partitions, remove_source);
 }
 
 TableFuturePtr Reduce(ExecutorPtr executor,
                       TableFuturePtr source_path,
-                      std::string script_command,
+                      Reducer reducer,
                       bool remove_source,
                       size_t block_size) {
-    auto split_result = Split(executor, std::move(source_path), remove_source, block_size, true);
-    auto perform_result = Perform(executor, std::move(split_result), std::move(script_command), true);
-    return Concatenate(executor, std::move(perform_result), true);
+    auto hot_keys = stage_settings.hot_key_rows > 0 ? std::make_shared<HotKeys>() : nullptr;
+    auto split_result = Run<Splitter, std::vector<std::string>>(executor, std::move(source_path), remove_source,
+                                                                block_size, true, 0, hot_keys);
+    auto reduce_result = reducer.function
+        ? RunForAll<NativeReducer, std::string>(executor, std::move(split_result), reducer.function, true)
+        : Perform(executor, std::move(split_result), reducer.script_command, true);
+    auto result = Concatenate(executor, std::move(reduce_result), true);
+    if (!hot_keys) {
+        return result;
+    }
+    return Run<HotKeyCombiner, std::string>(std::move(executor), std::move(result), std::move(reducer),
+                                            std::move(hot_keys));
 }
 
 TableFuturePtr MapReduce(ExecutorPtr executor,
                          TableFuturePtr source_path,
-                         std::string map_script_command,
-                         std::string reduce_script_command,
+                         Mapper mapper,
+                         Reducer reducer,
                          bool remove_source,
-                         size_t block_size) {
-    auto map_result = Map(executor, std::move(source_path), std::move(map_script_command), remove_source, block_size);
-    auto sort_result = Sort(executor, std::move(map_result), true, block_size);
-    return Reduce(executor, std::move(sort_result), std::move(reduce_script_command), true, block_size);
+                         size_t block_size,
+                         size_t partitions,
+                         const Combiner& combiner) {
+    if (stage_settings.streaming && partitions == 0) {
+        auto split_result = Split(executor, std::move(source_path), remove_source, block_size);
+        auto runs = MapSort(executor, split_result, std::move(mapper), true, block_size, combiner.function);
+        if (!combiner.script_command.empty()) {
+            runs = Combine(executor, runs, combiner, true);
+        }
+        auto reduce_result = MergeReduce(executor, runs, std::move(reducer), true, block_size);
+        return Concatenate(executor, reduce_result, true);
+    }
+    if (partitions > 0) {
+        auto split_result = Split(executor, std::move(source_path), remove_source, block_size);
+        auto map_result = Map(executor, split_result, std::move(mapper), true);
+        auto partition_result = Partition(executor, map_result, partitions, true);
+        auto double_future = executor->then<MultiTableFuturePtr>(partition_result, [=] {
+            std::vector<std::vector<std::string>> partition_paths(partitions);
+            for (const auto& source_partitions : partition_result->get()) {
+                for (size_t partition = 0; partition < partitions; ++partition) {
+                    partition_paths[partition].push_back(source_partitions[partition]);
+                }
+            }
+            std::vector<TableFuturePtr> reduce_results;
+            for (const auto& paths : partition_paths) {
+                auto sort_result = Sort(executor, DummyFuture(paths), true, block_size, combiner);
+                reduce_results.push_back(Reduce(executor, sort_result, reducer, true, block_size));
+            }
+            return executor->whenAll(reduce_results);
+        }, true);
+        return Concatenate(executor, executor->redirect(double_future), true);
+    }
+
+    // Sort splits the map results one by one, so they are never concatenated.
+    auto split_result = Split(executor, std::move(source_path), remove_source, block_size);
+    auto map_result = Map(executor, split_result, std::move(mapper), true);
+    auto sort_result = Sort(executor, std::move(map_result), true, block_size, combiner);
+    return Reduce(executor, std::move(sort_result), std::move(reducer), true, block_size);
 }
\ No newline at end of file
@@ -1,11 +1,17 @@
 #pragma once
 #include "executor.h"
 #include "table_io.h"
+#include "row_store.h"
+#include "table_merge.h"
 #include <boost/process.hpp>
 #include <fstream>
 #include <random>
 #include <string>
 #include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <functional>
+#include <unistd.h>
 
 namespace bp = boost::process;
 
@@ -15,6 +21,147 @@ std::atomic<size_t> tasks_count{0};
 const size_t default_block_size = 100'000;
 }
 
+// Settings of the intermediate tables written by each stage; set by the CLI
+// before a job is started. Sorted tables get a sparse index every
+// index_interval rows, 0 disables it. With virtual_split Splitter returns
+// table slices of uncompressed sources instead of copying the chunks.
+// NaiveSorter sorts chunks in sort_order using up to sort_threads threads.
+// Merges read at most merge_fan_in tables at once, 0 derives it from the
+// open files limit. With persistent_workers Performer feeds chunks to
+// long-running scripts of the WorkerPool instead of starting one per chunk.
+// With streaming MapReduce pipes the map output straight into sorted runs and
+// the merged runs straight into the reduce scripts. A memory_budget in bytes
+// makes sorts cut their runs by memory instead of block_size rows, lets
+// sorters and merges wait for their share of it and limits the merge fan-in
+// by the memory of the merge readers; 0 disables it. The last merge of a
+// sort is split into merge_ranges key ranges merged in parallel, one per core
+// if it is 0. With hot_key_rows the reducer is taken to be associative: Reduce
+// cuts key groups of more rows into several chunks and reduces the partial
+// results of such a hot key once more. At most max_scripts script processes
+// run at once over all tasks, one per core if it is 0.
+struct StageSettings {
+    TableFormat split = TableFormat::Binary;
+    TableFormat sort = TableFormat::CompressedBinary;
+    TableFormat merge = TableFormat::CompressedBinary;
+    size_t index_interval = default_index_interval;
+    bool virtual_split = true;
+    SortOrder sort_order = SortOrder::KeyValue;
+    size_t sort_threads = 1;
+    size_t merge_fan_in = 0;
+    bool persistent_workers = false;
+    bool streaming = false;
+    size_t memory_budget = 0;
+    size_t merge_ranges = 0;
+    size_t hot_key_rows = 0;
+    size_t max_scripts = 0;
+};
+
+inline StageSettings stage_settings;
+
+struct KeyGroupStats {
+    std::atomic<uint64_t> groups{0};
+    std::atomic<uint64_t> rows{0};
+    std::atomic<uint64_t> largest_group{0};
+    std::atomic<uint64_t> hot_groups{0};
+};
+
+// Totals over the key groups of all splits by key of this process.
+KeyGroupStats& GetKeyGroupStats();
+
+// Keys Splitter cut into several chunks, in key order.
+struct HotKeys {
+    std::vector<std::string> keys;
+};
+
+// Bytes of stage_settings.memory_budget reserved by running tasks.
+class MemoryBudget {
+public:
+    // Waits until the bytes fit into the budget and returns the reserved
+    // amount, which is capped by the budget and 0 without one.
+    size_t Acquire(size_t bytes);
+
+    void Release(size_t bytes);
+
+    size_t GetPeakUsage() const;
+
+private:
+    mutable std::mutex mutex_;
+    std::condition_variable released_cv_;
+    size_t used_ = 0;
+    size_t peak_ = 0;
+};
+
+MemoryBudget& GetMemoryBudget();
+
+// Slots of stage_settings.max_scripts taken by running script processes. A
+// task runs one script per slot, so a task running several scripts at once
+// stays within the limit too.
+class ScriptSlots {
+public:
+    // Waits until a slot is free.
+    void Acquire();
+
+    // Takes a slot only if one is free.
+    bool TryAcquire();
+
+    void Release(size_t slots);
+
+private:
+    std::mutex mutex_;
+    std::condition_variable released_cv_;
+    size_t used_ = 0;
+};
+
+ScriptSlots& GetScriptSlots();
+
+// Collapses all values of one key of a sorted chunk into a single value.
+using CombineFunction = std::function<std::string(std::string_view key,
+                                                  const std::vector<std::string_view>& values)>;
+
+// Sums integer values, e.g. the counts of a word count job.
+std::string SumCombine(std::string_view key, const std::vector<std::string_view>& values);
+
+// Combiners shrink sorted map chunks before they are merged. A script reads
+// sorted rows of any number of keys and prints combined rows in any order; a
+// native function is applied to every key. An empty combiner does nothing.
+struct Combiner {
+    std::string script_command;
+    CombineFunction function;
+};
+
+using Emit = std::function<void(std::string_view key, std::string_view value)>;
+
+// Native mappers are called for every row of a chunk and native reducers for
+// every key group, both inside executor threads, and pass their rows to emit.
+using MapFunction = std::function<void(std::string_view key, std::string_view value, const Emit& emit)>;
+
+using ReduceFunction = std::function<void(std::string_view key,
+                                          const std::vector<std::string_view>& values,
+                                          const Emit& emit)>;
+
+// Mappers and reducers are either script commands or native functions.
+struct Mapper {
+    Mapper(std::string script_command) : script_command(std::move(script_command)) {
+    }
+
+    Mapper(MapFunction function) : function(std::move(function)) {
+    }
+
+    std::string script_command;
+    MapFunction function;
+};
+
+struct Reducer {
+    Reducer(std::string script_command) : script_command(std::move(script_command)) {
+    }
+
+    Reducer(ReduceFunction function) : function(std::move(function)) {
+    }
+
+    std::string script_command;
+    ReduceFunction function;
+};
+
 template<class TIn, class TOut>
 class ITableTask : public Task {
 public:
@@ -45,10 +192,10 @@ public:
     ~ITableTask() override {
         if (remove_source_) {
             if constexpr(std::is_same_v<TIn, std::string>) {
-                bp::system("rm " + source_path_);
+                unlink(GetTableFile(source_path_).c_str());
             } else if constexpr(std::is_same_v<TIn, std::vector<std::string>>) {
                 for (const auto& source_path : source_path_) {
-                    bp::system("rm " + source_path);
+                    unlink(GetTableFile(source_path).c_str());
                 }
             }
         }
@@ -74,19 +221,34 @@ FuturePtr<T> DummyFuture(const T& data) {
     return future;
 }
 
+// Only the operator goes through the ready queue, the glue around it runs inline.
+// A failed source or operator fails the result, so errors reach the caller.
 template<class Operator, class TOut, class TIn, class ...TArgs>
 FuturePtr<TOut> Run(ExecutorPtr executor, FuturePtr<TIn> source_path, TArgs ...args) {
     auto future = std::make_shared<Future<TOut>>();
+    future->setRunInline();
     executor->then<Unit>(source_path, [=] {
-        auto task = std::make_shared<Operator>(executor, source_path->get(), args...);
+        std::shared_ptr<Operator> task;
+        try {
+            task = std::make_shared<Operator>(executor, source_path->get(), args...);
+        } catch (...) {
+            future->setFunc([error = std::current_exception()]() -> TOut {
+                std::rethrow_exception(error);
+            });
+            executor->submit(future);
+            throw;
+        }
         executor->submit(task);
         future->addDependency(task);
         future->setFunc([task] {
+            if (task->isFailed()) {
+                std::rethrow_exception(task->getError());
+            }
             return task->GetResult();
         });
         executor->submit(future);
         return Unit{};
-    });
+    }, true);
 
     return future;
 }
@@ -99,11 +261,13 @@ FuturePtr<std::vector<TOut>> RunForAll(ExecutorPtr executor, MultiTableFuturePtr
             futures.push_back(Run<Operator, TOut>(executor, DummyFuture(source_path), args...));
         }
         return executor->whenAll(futures);
-    });
+    }, true);
 
     return executor->redirect(double_future);
 }
 
+// Glues tables end to end. Sources of the result format are copied as bytes
+// inside the kernel, only tables of other formats are decoded.
 class Concatenater : public ITableTask<std::vector<std::string>, std::string> {
 public:
     Concatenater(ExecutorPtr executor,
@@ -126,39 +290,160 @@ protected:
     const std::string script_command_;
 };
 
+class NativeMapper : public ITableTask<std::string, std::string> {
+public:
+    NativeMapper(ExecutorPtr executor,
+                 std::string source_path,
+                 MapFunction function,
+                 bool remove_source = false);
+
+    void run() override;
+
+protected:
+    const MapFunction function_;
+};
+
+class NativeReducer : public ITableTask<std::string, std::string> {
+public:
+    NativeReducer(ExecutorPtr executor,
+                  std::string source_path,
+                  ReduceFunction function,
+                  bool remove_source = false);
+
+    void run() override;
+
+protected:
+    const ReduceFunction function_;
+};
+
 class Splitter : public ITableTask<std::string, std::vector<std::string>> {
 public:
     Splitter(ExecutorPtr executor,
              std::string source_path,
              bool remove_source = false,
              size_t block_size = default_block_size,
-             bool by_key = false);
+             bool by_key = false,
+             size_t max_chunk_bytes = 0,
+             std::shared_ptr<HotKeys> hot_keys = nullptr);
 
     void run() override;
 
 protected:
     const size_t block_size_;
     const bool by_key_;
+    const size_t max_chunk_bytes_;
+    const std::shared_ptr<HotKeys> hot_keys_;
+    std::string group_key_;
+    size_t group_rows_ = 0;
+
+    void SplitPhysically(TableReader& source);
+
+    bool SplitVirtually(TableReader& source);
+
+    // Counts the current row into its key group and returns whether a chunk
+    // of count rows ends before it. Chunks hold whole key groups, only hot
+    // keys are cut every block_size rows once they have hot_key_rows rows.
+    bool CountKeyRow(std::string_view key, size_t count);
+
+    void FinishKeyGroup();
 };
 
 class NaiveSorter : public ITableTask<std::string, std::string> {
 public:
     NaiveSorter(ExecutorPtr executor,
                 std::string source_path,
+                bool remove_source = false,
+                CombineFunction combine = nullptr);
+
+    void run() override;
+
+protected:
+    const CombineFunction combine_;
+};
+
+// Runs the mapper on the table and collects its output, read through a pipe
+// from scripts, into sorted runs of block_size rows, so unsorted map output
+// never hits the disk.
+class MapSorter : public ITableTask<std::string, std::vector<std::string>> {
+public:
+    MapSorter(ExecutorPtr executor,
+              std::string source_path,
+              Mapper mapper,
+              bool remove_source = false,
+              size_t block_size = default_block_size,
+              CombineFunction combine = nullptr);
+
+    void run() override;
+
+protected:
+    const Mapper mapper_;
+    const size_t block_size_;
+    const CombineFunction combine_;
+
+    void RunScript();
+
+    bool IsRunFull(const RowStore& rows) const;
+
+    void AddRun(RowStore& rows);
+};
+
+// Distributes the rows of a table over partition tables by key hash, so all
+// rows with the same key end up in the same partition.
+class Partitioner : public ITableTask<std::string, std::vector<std::string>> {
+public:
+    Partitioner(ExecutorPtr executor,
+                std::string source_path,
+                size_t partitions,
                 bool remove_source = false);
 
     void run() override;
+
+protected:
+    const size_t partitions_;
+};
+
+// Keys in [first, last); a missing bound leaves the range open.
+struct KeyRange {
+    std::optional<std::string> first;
+    std::optional<std::string> last;
 };
 
+// Merges the rows of any number of sorted tables in the key range in one pass.
 class Merger : public ITableTask<std::vector<std::string>, std::string> {
 public:
     Merger(ExecutorPtr executor,
-           std::vector<std::string> first_source_path,
-           bool remove_source = false);
+           std::vector<std::string> source_paths,
+           bool remove_source = false,
+           KeyRange range = {});
 
     void run() override;
+
+protected:
+    const KeyRange range_;
 };
 
+// Merges sorted tables and passes the merged rows straight to the reducer;
+// reduce scripts get them through pipes, each script whole key groups of at
+// least block_size rows. The results are in key order.
+class MergeReducer : public ITableTask<std::vector<std::string>, std::vector<std::string>> {
+public:
+    MergeReducer(ExecutorPtr executor,
+                 std::vector<std::string> source_paths,
+                 Reducer reducer,
+                 bool remove_source = false,
+                 size_t block_size = default_block_size);
+
+    void run() override;
+
+protected:
+    const Reducer reducer_;
+    const size_t block_size_;
+
+    void RunScripts(MergingReader& merged);
+};
+
+// Merges the tables with as few Merger passes as the merge fan-in allows;
+// the sources are removed by the first pass.
 class ListMerger : public ITableTask<std::vector<std::string>, TableFuturePtr> {
 public:
     ListMerger(ExecutorPtr executor,
@@ -168,9 +453,43 @@ public:
     void run() override;
 
 protected:
-    std::vector<std::string> source_links_;
+    const bool remove_sources_;
+};
+
+// Reduces the partial results of every hot key in a reduce result once more,
+// wherever the reducers wrote them, and copies the other rows as they are.
+// The source table is taken over.
+class HotKeyCombiner : public ITableTask<std::string, std::string> {
+public:
+    HotKeyCombiner(ExecutorPtr executor,
+                   std::string source_path,
+                   Reducer reducer,
+                   std::shared_ptr<HotKeys> hot_keys);
+
+    void run() override;
+
+protected:
+    const Reducer reducer_;
+    const std::shared_ptr<HotKeys> hot_keys_;
 
-    TableFuturePtr RecursiveMerge(size_t begin, size_t end);
+    void ReduceScript(const std::vector<TableItem>& rows, TableWriter& result);
+};
+
+// Picks splitter keys from the index samples of indexed sorted tables,
+// merges every key range in parallel and concatenates the ranges. Equal
+// keys always fall into one range.
+class RangeMerger : public ITableTask<std::vector<std::string>, TableFuturePtr> {
+public:
+    RangeMerger(ExecutorPtr executor,
+                std::vector<std::string> source_paths,
+                size_t ranges,
+                bool remove_source = false);
+
+    void run() override;
+
+protected:
+    const size_t ranges_;
+    const bool remove_sources_;
 };
 
 TableFuturePtr Concatenate(ExecutorPtr executor,
@@ -193,22 +512,37 @@ MultiTableFuturePtr Split(ExecutorPtr executor,
                           TableFuturePtr source_path,
                           bool remove_source = false,
                           size_t block_size = default_block_size,
-                          bool by_key = false);
+                          bool by_key = false,
+                          size_t max_chunk_bytes = 0);
 
 TableFuturePtr Map(ExecutorPtr executor,
                    TableFuturePtr source_path,
-                   std::string script_command,
+                   Mapper mapper,
                    bool remove_source = false,
                    size_t block_size = default_block_size);
 
+// Runs the mapper on every table.
+MultiTableFuturePtr Map(ExecutorPtr executor,
+                        MultiTableFuturePtr source_paths,
+                        Mapper mapper,
+                        bool remove_source = false);
+
 
 TableFuturePtr NaiveSort(ExecutorPtr executor,
                          TableFuturePtr source_path,
-                         bool remove_source = false);
+                         bool remove_source = false,
+                         CombineFunction combine = nullptr);
 
 MultiTableFuturePtr NaiveSort(ExecutorPtr executor,
                               MultiTableFuturePtr source_path,
-                              bool remove_source = false);
+                              bool remove_source = false,
+                              CombineFunction combine = nullptr);
+
+// Applies the combiner to every sorted table; the results are sorted too.
+MultiTableFuturePtr Combine(ExecutorPtr executor,
+                            MultiTableFuturePtr source_paths,
+                            const Combiner& combiner,
+                            bool remove_source = false);
 
 TableFuturePtr Merge(ExecutorPtr executor,
                      TableFuturePtr first_source_path,
@@ -219,20 +553,59 @@ TableFuturePtr Merge(ExecutorPtr executor,
                      MultiTableFuturePtr source_paths,
                      bool remove_source = false);
 
+// The combiner, if any, is applied to the sorted chunks before merging.
 TableFuturePtr Sort(ExecutorPtr executor,
                     TableFuturePtr source_path,
                     bool remove_source = false,
-                    size_t block_size = default_block_size);
+                    size_t block_size = default_block_size,
+                    const Combiner& combiner = {});
 
+// Sorts the rows of all the tables into one table.
+TableFuturePtr Sort(ExecutorPtr executor,
+                    MultiTableFuturePtr source_paths,
+                    bool remove_source = false,
+                    size_t block_size = default_block_size,
+                    const Combiner& combiner = {});
+
+// Runs the mapper on every table and returns the sorted runs of its output.
+MultiTableFuturePtr MapSort(ExecutorPtr executor,
+                            MultiTableFuturePtr source_paths,
+                            Mapper mapper,
+                            bool remove_source = false,
+                            size_t block_size = default_block_size,
+                            CombineFunction combine = nullptr);
+
+// Reduces the merged rows of sorted tables without writing the merge result.
+MultiTableFuturePtr MergeReduce(ExecutorPtr executor,
+                                MultiTableFuturePtr source_paths,
+                                Reducer reducer,
+                                bool remove_source = false,
+                                size_t block_size = default_block_size);
+
+// Returns the partition tables of every source table.
+FuturePtr<std::vector<std::vector<std::string>>> Partition(ExecutorPtr executor,
+                                                           MultiTableFuturePtr source_paths,
+                                                           size_t partitions,
+                                                           bool remove_source = false);
+
+// Reduce scripts are run on chunks of whole key groups of at least
+// block_size rows (or the remaining rows), so a script reads consecutive rows
+// of several keys in sorted order and has to reduce every key separately.
+// With block_size 1 every key gets its own invocation.
 TableFuturePtr Reduce(ExecutorPtr executor,
                       TableFuturePtr source_path,
-                      std::string script_command,
+                      Reducer reducer,
                       bool remove_source = false,
                       size_t block_size = default_block_size);
 
+// With partitions > 0 the map output is shuffled into that many hash
+// partitions which are sorted and reduced independently instead of sorting
+// all of it at once; the result is then grouped but not sorted by key.
 TableFuturePtr MapReduce(ExecutorPtr executor,
                          TableFuturePtr source_path,
-                         std::string map_script_command,
-                         std::string reduce_script_command,
+                         Mapper mapper,
+                         Reducer reducer,
                          bool remove_source = false,
-                         size_t block_size = default_block_size);
+                         size_t block_size = default_block_size,
+                         size_t partitions = 0,
+                         const Combiner& combiner = {});
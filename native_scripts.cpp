@@ -0,0 +1,56 @@
+#include "native_scripts.h"
+#include <cctype>
+
+namespace {
+const std::string_view native_prefix("native:");
+
+std::optional<std::string_view> GetNativeName(std::string_view command) {
+    if (command.substr(0, native_prefix.size()) != native_prefix) {
+        return std::nullopt;
+    }
+    return command.substr(native_prefix.size());
+}
+}
+
+void WordCountMap(std::string_view, std::string_view value, const Emit& emit) {
+    size_t position = 0;
+    while (true) {
+        while (position < value.size() && std::isspace(static_cast<unsigned char>(value[position]))) {
+            ++position;
+        }
+        if (position == value.size()) {
+            return;
+        }
+        size_t begin = position;
+        while (position < value.size() && !std::isspace(static_cast<unsigned char>(value[position]))) {
+            ++position;
+        }
+        emit(value.substr(begin, position - begin), "1");
+    }
+}
+
+void SumReduce(std::string_view key, const std::vector<std::string_view>& values, const Emit& emit) {
+    emit(key, SumCombine(key, values));
+}
+
+Mapper FindMapper(const std::string& command) {
+    auto name = GetNativeName(command);
+    if (!name.has_value()) {
+        return Mapper(command);
+    }
+    if (name == "word_count") {
+        return Mapper(MapFunction(WordCountMap));
+    }
+    throw std::runtime_error("Unknown native mapper " + command);
+}
+
+Reducer FindReducer(const std::string& command) {
+    auto name = GetNativeName(command);
+    if (!name.has_value()) {
+        return Reducer(command);
+    }
+    if (name == "sum") {
+        return Reducer(ReduceFunction(SumReduce));
+    }
+    throw std::runtime_error("Unknown native reducer " + command);
+}
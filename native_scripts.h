@@ -0,0 +1,13 @@
+#pragma once
+#include "mapreduce.h"
+
+// Native equivalents of MapScript and ReduceScript.
+void WordCountMap(std::string_view key, std::string_view value, const Emit& emit);
+
+void SumReduce(std::string_view key, const std::vector<std::string_view>& values, const Emit& emit);
+
+// Commands of the form "native:<name>" select a built-in native function,
+// anything else is run as a script.
+Mapper FindMapper(const std::string& command);
+
+Reducer FindReducer(const std::string& command);
@@ -1,19 +1,38 @@
+#include <cstdlib>
 #include <iostream>
-#include <cassert>
 #include <optional>
 
+// Sums the values of every key; the rows of a key are consecutive. In
+// persistent mode the input is a sequence of chunks, each ending with a line
+// holding only the record separator, which is echoed after the chunk.
 int main() {
-    std::string key;
+    const std::string chunk_end("\x1e");
+    bool persistent = std::getenv("MAPREDUCE_PERSISTENT") != nullptr;
+    std::string row;
     std::optional<std::string> prev_key;
     int64_t sum = 0;
-    while (std::getline(std::cin, key, '\t')) {
-        int64_t value;
-        std::cin >> value;
+    while (std::getline(std::cin, row)) {
+        if (persistent && row == chunk_end) {
+            if (prev_key.has_value()) {
+                std::cout << prev_key.value() << "\t" << sum << "\n";
+            }
+            std::cout << chunk_end << std::endl;
+            prev_key.reset();
+            sum = 0;
+            continue;
+        }
+        size_t tab = row.find('\t');
+        std::string key = row.substr(0, tab);
+        int64_t value = std::stoll(row.substr(tab + 1));
+        if (prev_key.has_value() && prev_key != key) {
+            std::cout << prev_key.value() << "\t" << sum << "\n";
+            sum = 0;
+        }
         sum += value;
-        assert(!prev_key.has_value() || prev_key == key);
         prev_key = key;
-        std::getline(std::cin, key);
     }
-    std::cout << prev_key.value() << "\t" << sum << "\n";
+    if (prev_key.has_value()) {
+        std::cout << prev_key.value() << "\t" << sum << "\n";
+    }
     return 0;
 }
@@ -0,0 +1,214 @@
+#include "row_store.h"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+const size_t radix_sort_threshold = 64;
+const size_t parallel_sort_threshold = 1 << 16;
+const int key_prefix_bytes = 8;
+
+int GetPrefixByte(const RowStore::Row& row, int byte) {
+    return static_cast<int>((row.key_prefix >> (8 * (key_prefix_bytes - 1 - byte))) & 0xff);
+}
+
+uint64_t GetKeyPrefix(std::string_view key) {
+    uint64_t prefix = 0;
+    size_t size = std::min<size_t>(key.size(), sizeof(prefix));
+    for (size_t i = 0; i < size; ++i) {
+        prefix |= static_cast<uint64_t>(static_cast<unsigned char>(key[i])) << (8 * (7 - i));
+    }
+    return prefix;
+}
+}
+
+void RowStore::Reserve(size_t rows, size_t bytes) {
+    rows_.reserve(rows);
+    arena_.reserve(bytes);
+}
+
+void RowStore::Add(std::string_view key, std::string_view value) {
+    if (key.size() > std::numeric_limits<uint32_t>::max() || value.size() > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("Row is too large to be sorted in memory");
+    }
+    rows_.push_back({GetKeyPrefix(key), arena_.size(),
+                     static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size())});
+    arena_.insert(arena_.end(), key.begin(), key.end());
+    arena_.insert(arena_.end(), value.begin(), value.end());
+}
+
+void RowStore::Append(TableReader& reader) {
+    for (; !reader.Empty(); reader.Next()) {
+        Add(reader.GetKeyView(), reader.GetValueView());
+    }
+}
+
+size_t RowStore::Size() const {
+    return rows_.size();
+}
+
+std::string_view RowStore::GetKey(const Row& row) const {
+    return {arena_.data() + row.offset, row.key_size};
+}
+
+std::string_view RowStore::GetValue(const Row& row) const {
+    return {arena_.data() + row.offset + row.key_size, row.value_size};
+}
+
+std::vector<RowStore::Row>& RowStore::GetRows() {
+    return rows_;
+}
+
+bool RowStore::Less(const Row& first, const Row& second) const {
+    if (first.key_prefix != second.key_prefix) {
+        return first.key_prefix < second.key_prefix;
+    }
+    int order = GetKey(first).compare(GetKey(second));
+    if (order != 0) {
+        return order < 0;
+    }
+    return GetValue(first) < GetValue(second);
+}
+
+bool RowStore::KeyLess(const Row& first, const Row& second) const {
+    if (first.key_prefix != second.key_prefix) {
+        return first.key_prefix < second.key_prefix;
+    }
+    return GetKey(first) < GetKey(second);
+}
+
+void RowStore::ComparisonSort(SortOrder order) {
+    FallbackSort(rows_.data(), rows_.size(), false, order);
+}
+
+void RowStore::Sort(SortOrder order, size_t threads) {
+    if (rows_.size() < 2) {
+        return;
+    }
+    std::vector<Row> buffer(rows_.size());
+    if (threads <= 1 || rows_.size() < parallel_sort_threshold) {
+        RadixSort(rows_.data(), buffer.data(), rows_.size(), 0, order);
+        return;
+    }
+
+    // Distribute by the first prefix byte, then sort the buckets in parallel.
+    size_t begins[257] = {};
+    for (const auto& row : rows_) {
+        ++begins[GetPrefixByte(row, 0) + 1];
+    }
+    for (int bucket = 0; bucket < 256; ++bucket) {
+        begins[bucket + 1] += begins[bucket];
+    }
+    size_t positions[256];
+    std::copy(begins, begins + 256, positions);
+    for (const auto& row : rows_) {
+        buffer[positions[GetPrefixByte(row, 0)]++] = row;
+    }
+    rows_.swap(buffer);
+
+    std::vector<int> buckets(256);
+    for (int bucket = 0; bucket < 256; ++bucket) {
+        buckets[bucket] = bucket;
+    }
+    std::sort(buckets.begin(), buckets.end(), [&begins](int first, int second) {
+        return begins[first + 1] - begins[first] > begins[second + 1] - begins[second];
+    });
+    std::vector<std::vector<int>> assigned(threads);
+    std::vector<size_t> load(threads);
+    for (int bucket : buckets) {
+        size_t thread = std::min_element(load.begin(), load.end()) - load.begin();
+        assigned[thread].push_back(bucket);
+        load[thread] += begins[bucket + 1] - begins[bucket];
+    }
+    std::vector<std::thread> workers;
+    for (const auto& thread_buckets : assigned) {
+        workers.emplace_back([&, thread_buckets] {
+            for (int bucket : thread_buckets) {
+                RadixSort(rows_.data() + begins[bucket], buffer.data() + begins[bucket],
+                          begins[bucket + 1] - begins[bucket], 1, order);
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void RowStore::RadixSort(Row* rows, Row* buffer, size_t size, int byte, SortOrder order) const {
+    while (true) {
+        if (size < radix_sort_threshold || byte == key_prefix_bytes) {
+            FallbackSort(rows, size, byte == key_prefix_bytes, order);
+            return;
+        }
+        size_t begins[257] = {};
+        for (size_t i = 0; i < size; ++i) {
+            ++begins[GetPrefixByte(rows[i], byte) + 1];
+        }
+        // All rows share this byte, go on with the next one without moving them.
+        if (std::find(begins + 1, begins + 257, size) != begins + 257) {
+            ++byte;
+            continue;
+        }
+        for (int bucket = 0; bucket < 256; ++bucket) {
+            begins[bucket + 1] += begins[bucket];
+        }
+        size_t positions[256];
+        std::copy(begins, begins + 256, positions);
+        for (size_t i = 0; i < size; ++i) {
+            buffer[positions[GetPrefixByte(rows[i], byte)]++] = rows[i];
+        }
+        std::copy(buffer, buffer + size, rows);
+        for (int bucket = 0; bucket < 256; ++bucket) {
+            size_t bucket_size = begins[bucket + 1] - begins[bucket];
+            if (bucket_size > 1) {
+                RadixSort(rows + begins[bucket], buffer + begins[bucket], bucket_size, byte + 1, order);
+            }
+        }
+        return;
+    }
+}
+
+void RowStore::FallbackSort(Row* rows, size_t size, bool prefix_consumed, SortOrder order) const {
+    if (prefix_consumed && order != SortOrder::KeyValue) {
+        // Keys that fit into the shared prefix and have equal sizes are equal.
+        bool equal_keys = std::all_of(rows, rows + size, [rows](const Row& row) {
+            return row.key_size <= key_prefix_bytes && row.key_size == rows[0].key_size;
+        });
+        if (equal_keys) {
+            return;
+        }
+    }
+    switch (order) {
+        case SortOrder::KeyValue:
+            std::sort(rows, rows + size, [this](const Row& first, const Row& second) {
+                return Less(first, second);
+            });
+            break;
+        case SortOrder::Key:
+            std::sort(rows, rows + size, [this](const Row& first, const Row& second) {
+                return KeyLess(first, second);
+            });
+            break;
+        case SortOrder::StableKey:
+            std::stable_sort(rows, rows + size, [this](const Row& first, const Row& second) {
+                return KeyLess(first, second);
+            });
+            break;
+    }
+}
+
+void RowStore::Write(TableWriter& writer) const {
+    for (const auto& row : rows_) {
+        writer.Write(GetKey(row), GetValue(row));
+    }
+}
+
+size_t RowStore::GetMemoryUsage() const {
+    return arena_.capacity() + rows_.capacity() * sizeof(Row);
+}
+
+size_t RowStore::GetRowMemory(size_t key_size, size_t value_size) {
+    return key_size + value_size + 2 * sizeof(Row);
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include "table_io.h"
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// KeyValue orders rows like TableItem pairs; Key only groups and orders keys,
+// leaving equal keys in any order, StableKey keeps them in input order.
+enum class SortOrder {
+    KeyValue,
+    Key,
+    StableKey
+};
+
+// Rows of a table chunk packed into a single arena. Every row is described
+// by a compact record with the first key bytes as a big endian prefix, so
+// that sorting permutes 24 byte records and mostly compares integers
+// instead of moving and comparing strings.
+class RowStore {
+public:
+    struct Row {
+        uint64_t key_prefix;
+        uint64_t offset;
+        uint32_t key_size;
+        uint32_t value_size;
+    };
+
+    void Reserve(size_t rows, size_t bytes);
+
+    void Add(std::string_view key, std::string_view value);
+
+    void Append(TableReader& reader);
+
+    size_t Size() const;
+
+    std::string_view GetKey(const Row& row) const;
+
+    std::string_view GetValue(const Row& row) const;
+
+    std::vector<Row>& GetRows();
+
+    // Compares keys, then values, as the sort of TableItem pairs does.
+    bool Less(const Row& first, const Row& second) const;
+
+    bool KeyLess(const Row& first, const Row& second) const;
+
+    // MSD radix sort over the key prefixes that falls back to comparison
+    // sorts for small buckets and for rows sharing the whole prefix. Buckets
+    // of the first pass are sorted by up to threads threads.
+    void Sort(SortOrder order = SortOrder::KeyValue, size_t threads = 1);
+
+    // The plain comparison sort, kept for comparison with Sort().
+    void ComparisonSort(SortOrder order = SortOrder::KeyValue);
+
+    void Write(TableWriter& writer) const;
+
+    // Bytes held by the arena and the row records.
+    size_t GetMemoryUsage() const;
+
+    // Bytes a row takes while it is sorted, counting the sort buffer.
+    static size_t GetRowMemory(size_t key_size, size_t value_size);
+
+private:
+    std::vector<char> arena_;
+    std::vector<Row> rows_;
+
+    void RadixSort(Row* rows, Row* buffer, size_t size, int byte, SortOrder order) const;
+
+    void FallbackSort(Row* rows, size_t size, bool prefix_consumed, SortOrder order) const;
+};
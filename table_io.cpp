@@ -1,22 +1,501 @@
 #include "table_io.h"
+#include "delimiter_scan.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <limits>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <utility>
+#include <zlib.h>
 
-TableReader::TableReader(const std::string& table_path)
-    : table_stream_(table_path) {
+namespace {
+const size_t max_varint_size = 10;
+const size_t compressed_block_size = 64 << 10;
+const size_t copy_buffer_size = 1 << 20;
+const int compression_level = 1;
+
+// Split slices hard link their source files, so a table file with several
+// links is replaced by a new file instead of being truncated in place.
+int CreateTableFile(const std::string& table_path) {
+    struct stat file_stat{};
+    if (lstat(table_path.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_nlink > 1) {
+        unlink(table_path.c_str());
+    }
+    return open(table_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+char* EncodeVarint(char* out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = static_cast<char>(value);
+    return out;
+}
+
+uint64_t DecodeVarint(std::string_view data, size_t& position) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64 && position < data.size(); shift += 7) {
+        auto byte = static_cast<unsigned char>(data[position++]);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    throw std::runtime_error("Corrupted binary table row");
+}
+
+uint64_t DecodeVarint(std::istream& stream) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = stream.get();
+        if (byte == EOF) {
+            break;
+        }
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    throw std::runtime_error("Corrupted binary table row");
+}
+
+char* Copy(char* out, std::string_view piece) {
+    if (piece.empty()) {
+        return out;
+    }
+    std::memcpy(out, piece.data(), piece.size());
+    return out + piece.size();
+}
+
+TableFormat RowEncoding(TableFormat format) {
+    return format == TableFormat::Text ? TableFormat::Text : TableFormat::Binary;
+}
+
+// Falls back to storing the block as is when compression doesn't help.
+void CompressBlock(std::string_view raw, std::string& stored) {
+    uLongf stored_size = compressBound(raw.size());
+    stored.resize(stored_size);
+    int code = compress2(reinterpret_cast<Bytef*>(stored.data()), &stored_size,
+                         reinterpret_cast<const Bytef*>(raw.data()), raw.size(), compression_level);
+    if (code != Z_OK) {
+        throw std::runtime_error("Table block compression failed");
+    }
+    if (stored_size >= raw.size()) {
+        stored.assign(raw);
+    } else {
+        stored.resize(stored_size);
+    }
+}
+
+void DecompressBlock(std::string_view stored, size_t raw_size, std::string& raw) {
+    raw.resize(raw_size);
+    uLongf size = raw_size;
+    int code = uncompress(reinterpret_cast<Bytef*>(raw.data()), &size,
+                          reinterpret_cast<const Bytef*>(stored.data()), stored.size());
+    if (code != Z_OK || size != raw_size) {
+        throw std::runtime_error("Corrupted compressed table block");
+    }
+}
+
+// Returns the format of a binary table header and whether it is indexed.
+std::optional<TableFormat> ParseHeader(std::string_view header, bool& indexed) {
+    if (header.size() != binary_table_magic.size()) {
+        return std::nullopt;
+    }
+    std::string plain(header);
+    indexed = plain[table_flags_position] & indexed_table_flag;
+    plain[table_flags_position] &= ~indexed_table_flag;
+    if (plain == binary_table_magic) {
+        return TableFormat::Binary;
+    }
+    if (plain == compressed_table_magic) {
+        return TableFormat::CompressedBinary;
+    }
+    return std::nullopt;
+}
+
+const size_t footer_trailer_size = 8 + table_footer_magic.size();
+
+uint64_t ParseFooterOffset(std::string_view trailer) {
+    if (trailer.size() != footer_trailer_size || trailer.substr(8) != table_footer_magic) {
+        throw std::runtime_error("Bad table index footer");
+    }
+    uint64_t offset = 0;
+    for (int i = 7; i >= 0; --i) {
+        offset = (offset << 8) | static_cast<unsigned char>(trailer[i]);
+    }
+    return offset;
+}
+}
+
+void CopyFileRange(int input_fd, uint64_t offset, uint64_t size, int output_fd) {
+    struct stat input_stat{};
+    off_t output_offset = lseek(output_fd, 0, SEEK_CUR);
+    if (fstat(input_fd, &input_stat) == 0 && output_offset >= 0 && input_stat.st_blksize > 0) {
+        uint64_t block = input_stat.st_blksize;
+        bool aligned = offset % block == 0 && output_offset % block == 0 &&
+                       (size % block == 0 || offset + size == static_cast<uint64_t>(input_stat.st_size));
+        file_clone_range range{input_fd, offset, size, static_cast<uint64_t>(output_offset)};
+        if (aligned && ioctl(output_fd, FICLONERANGE, &range) == 0) {
+            lseek(output_fd, output_offset + size, SEEK_SET);
+            return;
+        }
+    }
+
+    auto input_offset = static_cast<off_t>(offset);
+    uint64_t left = size;
+    while (left > 0) {
+        ssize_t copied = copy_file_range(input_fd, &input_offset, output_fd, nullptr, left, 0);
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied <= 0) {
+            break;
+        }
+        left -= copied;
+    }
+
+    // Pipes and some file system pairs don't support copy_file_range.
+    std::vector<char> buffer(std::min<uint64_t>(left, copy_buffer_size));
+    while (left > 0) {
+        ssize_t size_read = pread(input_fd, buffer.data(), std::min<uint64_t>(left, buffer.size()), input_offset);
+        if (size_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (size_read <= 0) {
+            throw std::runtime_error("Table file is shorter than the copied range");
+        }
+        for (ssize_t done = 0; done < size_read;) {
+            ssize_t written = write(output_fd, buffer.data() + done, size_read - done);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written < 0) {
+                throw std::runtime_error(std::string("Table write failed: ") + std::strerror(errno));
+            }
+            done += written;
+        }
+        input_offset += size_read;
+        left -= size_read;
+    }
+}
+
+CompressionStats& GetCompressionStats() {
+    static CompressionStats stats;
+    return stats;
+}
+
+TableFormat DetectTableFormat(const std::string& table_path) {
+    std::ifstream table_stream(GetTableFile(table_path), std::ios::binary);
+    std::string header(binary_table_magic.size(), '\0');
+    table_stream.read(header.data(), header.size());
+    header.resize(table_stream.gcount());
+    bool indexed;
+    return ParseHeader(header, indexed).value_or(TableFormat::Text);
+}
+
+std::string FormatTableSlice(const TableSlice& slice) {
+    return "slice:" + std::to_string(slice.begin) + ":" + std::to_string(slice.end) + ":" + slice.path;
+}
+
+std::optional<TableSlice> ParseTableSlice(const std::string& table_path) {
+    const std::string_view prefix = "slice:";
+    if (table_path.compare(0, prefix.size(), prefix) != 0) {
+        return std::nullopt;
+    }
+    size_t begin_end = table_path.find(':', prefix.size());
+    size_t end_end = begin_end == std::string::npos ? begin_end : table_path.find(':', begin_end + 1);
+    if (end_end == std::string::npos) {
+        throw std::runtime_error("Bad table slice " + table_path);
+    }
+    return TableSlice{table_path.substr(end_end + 1),
+                      std::stoull(table_path.substr(prefix.size(), begin_end - prefix.size())),
+                      std::stoull(table_path.substr(begin_end + 1, end_end - begin_end - 1))};
+}
+
+std::string GetTableFile(const std::string& table_path) {
+    auto slice = ParseTableSlice(table_path);
+    return slice.has_value() ? slice->path : table_path;
+}
+
+MappedFile::~MappedFile() {
+    if (open_ && size_ > 0) {
+        munmap(const_cast<char*>(data_), size_);
+    }
+}
+
+bool MappedFile::Open(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info{};
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        close(fd);
+        return false;
+    }
+    size_ = info.st_size;
+    if (size_ > 0) {
+        void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            size_ = 0;
+            return false;
+        }
+        madvise(data, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const char*>(data);
+    }
+    close(fd);
+    open_ = true;
+    return true;
+}
+
+bool MappedFile::IsOpen() const {
+    return open_;
+}
+
+std::string_view MappedFile::GetData() const {
+    return {data_, size_};
+}
+
+TableReader::TableReader(const std::string& table, ReadMode mode) {
+    auto slice = ParseTableSlice(table);
+    const std::string& table_path = slice.has_value() ? slice->path : table;
+    file_path_ = table_path;
+    auto apply_slice = [this, &slice] {
+        if (slice.has_value()) {
+            rows_begin_ = std::max(rows_begin_, slice->begin);
+            rows_end_ = std::min(rows_end_, slice->end);
+        }
+    };
+
+    if (mode == ReadMode::Mmap && mapped_file_.Open(table_path)) {
+        std::string_view file = mapped_file_.GetData();
+        if (!file.empty() && file[0] == binary_table_magic[0]) {
+            ReadHeader(file.substr(0, binary_table_magic.size()), table_path);
+            rows_begin_ = binary_table_magic.size();
+        }
+        if (indexed_) {
+            if (file.size() < rows_begin_ + footer_trailer_size) {
+                throw std::runtime_error("Missing index footer in " + table_path);
+            }
+            rows_end_ = ParseFooterOffset(file.substr(file.size() - footer_trailer_size));
+            if (rows_end_ > file.size() - footer_trailer_size) {
+                throw std::runtime_error("Bad index footer offset in " + table_path);
+            }
+            ReadFooter(file.substr(rows_end_, file.size() - footer_trailer_size - rows_end_));
+        }
+        rows_end_ = std::min<uint64_t>(rows_end_, file.size());
+        apply_slice();
+        if (format_ != TableFormat::CompressedBinary) {
+            data_ = file.substr(0, rows_end_);
+        }
+        Reposition(rows_begin_);
+        return;
+    }
+
+    table_stream_.open(table_path, std::ios::binary);
+    if (table_stream_.peek() == binary_table_magic[0]) {
+        std::string header(binary_table_magic.size(), '\0');
+        table_stream_.read(header.data(), header.size());
+        ReadHeader(header, table_path);
+        rows_begin_ = binary_table_magic.size();
+    }
+    if (indexed_) {
+        std::string trailer(footer_trailer_size, '\0');
+        table_stream_.seekg(-static_cast<std::streamoff>(footer_trailer_size), std::ios::end);
+        uint64_t footer_end = table_stream_.tellg();
+        table_stream_.read(trailer.data(), trailer.size());
+        rows_end_ = ParseFooterOffset(trailer);
+        if (!table_stream_ || rows_end_ > footer_end) {
+            throw std::runtime_error("Bad index footer in " + table_path);
+        }
+        std::string footer(footer_end - rows_end_, '\0');
+        table_stream_.seekg(rows_end_);
+        table_stream_.read(footer.data(), footer.size());
+        ReadFooter(footer);
+    }
+    if (indexed_ || slice.has_value()) {
+        apply_slice();
+        Reposition(rows_begin_);
+        return;
+    }
+    Next();
+}
+
+void TableReader::ReadHeader(std::string_view header, const std::string& table_path) {
+    auto format = ParseHeader(header, indexed_);
+    if (!format.has_value()) {
+        throw std::runtime_error("Bad binary table header in " + table_path);
+    }
+    format_ = format.value();
+}
+
+void TableReader::ReadFooter(std::string_view footer) {
+    size_t position = 0;
+    index_.resize(DecodeVarint(footer, position));
+    row_count_ = DecodeVarint(footer, position);
+    for (auto& entry : index_) {
+        entry.row = DecodeVarint(footer, position);
+        entry.offset = DecodeVarint(footer, position);
+        size_t key_size = DecodeVarint(footer, position);
+        if (footer.size() - position < key_size) {
+            throw std::runtime_error("Truncated table index footer");
+        }
+        entry.key = footer.substr(position, key_size);
+        position += key_size;
+    }
+}
+
+void TableReader::Reposition(uint64_t offset) {
+    if (format_ == TableFormat::CompressedBinary) {
+        data_ = {};
+        position_ = 0;
+        file_position_ = offset;
+    } else if (mapped_file_.IsOpen()) {
+        position_ = offset;
+    }
+    if (!mapped_file_.IsOpen()) {
+        table_stream_.clear();
+        table_stream_.seekg(offset);
+    }
+    empty_ = false;
     Next();
 }
 
 bool TableReader::Next() {
-    if (HasNext()) {
-        std::getline(table_stream_, key_, '\t');
-        std::getline(table_stream_, value_);
-        return true;
-    } else {
+    if (!HasNext()) {
+        raw_row_view_ = data_.substr(position_, 0);
         empty_ = true;
         return false;
     }
+    ReadRow();
+    if (upper_bound_.has_value() && key_view_ >= upper_bound_.value()) {
+        empty_ = true;
+        return false;
+    }
+    return true;
+}
+
+bool TableReader::ReadRow() {
+    switch (format_) {
+        case TableFormat::Text:
+            return mapped_file_.IsOpen() ? NextMapped() : NextStream();
+        case TableFormat::Binary:
+            return mapped_file_.IsOpen() ? NextBinary() : NextStreamBinary();
+        case TableFormat::CompressedBinary:
+            if (position_ == data_.size()) {
+                LoadBlock();
+            }
+            return NextBinary();
+    }
+    return false;
+}
+
+void TableReader::LoadBlock() {
+    size_t raw_size;
+    std::string_view stored;
+    if (mapped_file_.IsOpen()) {
+        std::string_view file = mapped_file_.GetData();
+        raw_size = DecodeVarint(file, file_position_);
+        size_t stored_size = DecodeVarint(file, file_position_);
+        if (file.size() - file_position_ < stored_size) {
+            throw std::runtime_error("Truncated compressed table block");
+        }
+        stored = file.substr(file_position_, stored_size);
+        file_position_ += stored_size;
+    } else {
+        raw_size = DecodeVarint(table_stream_);
+        stored_block_.resize(DecodeVarint(table_stream_));
+        table_stream_.read(stored_block_.data(), stored_block_.size());
+        if (!table_stream_) {
+            throw std::runtime_error("Truncated compressed table block");
+        }
+        stored = stored_block_;
+    }
+    if (stored.size() == raw_size) {
+        data_ = stored;
+    } else {
+        DecompressBlock(stored, raw_size, block_);
+        data_ = block_;
+    }
+    position_ = 0;
+}
+
+bool TableReader::NextMapped() {
+    const char* begin = data_.data() + position_;
+    const char* end = data_.data() + data_.size();
+    const char* delimiter = FindEither(begin, end, '\t', '\n');
+    const char* line_end = delimiter;
+    if (delimiter != end && *delimiter == '\t') {
+        line_end = FindByte(delimiter + 1, end, '\n');
+        key_view_ = {begin, static_cast<size_t>(delimiter - begin)};
+        value_view_ = {delimiter + 1, static_cast<size_t>(line_end - delimiter - 1)};
+    } else {
+        key_view_ = {begin, static_cast<size_t>(line_end - begin)};
+        value_view_ = {};
+    }
+    const char* row_end = line_end == end ? end : line_end + 1;
+    raw_row_view_ = {begin, static_cast<size_t>(row_end - begin)};
+    position_ = row_end - data_.data();
+    return true;
+}
+
+bool TableReader::NextBinary() {
+    size_t begin = position_;
+    size_t key_size = DecodeVarint(data_, position_);
+    size_t value_size = DecodeVarint(data_, position_);
+    if (data_.size() - position_ < key_size || data_.size() - position_ - key_size < value_size) {
+        throw std::runtime_error("Truncated binary table row");
+    }
+    key_view_ = data_.substr(position_, key_size);
+    value_view_ = data_.substr(position_ + key_size, value_size);
+    position_ += key_size + value_size;
+    raw_row_view_ = data_.substr(begin, position_ - begin);
+    return true;
+}
+
+bool TableReader::NextStream() {
+    std::getline(table_stream_, key_, '\t');
+    std::getline(table_stream_, value_);
+    key_view_ = key_;
+    value_view_ = value_;
+    return true;
+}
+
+bool TableReader::NextStreamBinary() {
+    key_.resize(DecodeVarint(table_stream_));
+    value_.resize(DecodeVarint(table_stream_));
+    table_stream_.read(key_.data(), key_.size());
+    table_stream_.read(value_.data(), value_.size());
+    if (!table_stream_) {
+        throw std::runtime_error("Truncated binary table row");
+    }
+    key_view_ = key_;
+    value_view_ = value_;
+    return true;
 }
 
 bool TableReader::HasNext() {
+    if (position_ < data_.size()) {
+        return true;
+    }
+    if (mapped_file_.IsOpen()) {
+        return format_ == TableFormat::CompressedBinary && file_position_ < rows_end_;
+    }
+    if (rows_end_ != std::numeric_limits<uint64_t>::max()) {
+        auto position = table_stream_.tellg();
+        return position >= 0 && static_cast<uint64_t>(position) < rows_end_;
+    }
     return table_stream_.peek() != EOF;
 }
 
@@ -24,20 +503,93 @@ bool TableReader::Empty() {
     return empty_;
 }
 
-const std::string& TableReader::GetKey() const {
-    return key_;
+std::string_view TableReader::GetKeyView() const {
+    return key_view_;
+}
+
+std::string_view TableReader::GetValueView() const {
+    return value_view_;
+}
+
+bool TableReader::IsMapped() const {
+    return mapped_file_.IsOpen() && format_ != TableFormat::CompressedBinary;
+}
+
+TableFormat TableReader::GetFormat() const {
+    return format_;
 }
 
-const std::string& TableReader::GetValue() const {
-    return value_;
+std::string_view TableReader::GetRawRow() const {
+    return raw_row_view_;
+}
+
+uint64_t TableReader::GetRowOffset() const {
+    return raw_row_view_.data() - mapped_file_.GetData().data();
+}
+
+std::string TableReader::GetKey() const {
+    return std::string(key_view_);
+}
+
+std::string TableReader::GetValue() const {
+    return std::string(value_view_);
 }
 
 std::string TableReader::GetRow() const {
-    return key_ + '\t' + value_;
+    std::string row;
+    row.reserve(key_view_.size() + value_view_.size() + 1);
+    row.append(key_view_).append(1, '\t').append(value_view_);
+    return row;
 }
 
 std::pair<std::string, std::string> TableReader::GetItem() const {
-    return std::make_pair(key_, value_);
+    return std::make_pair(GetKey(), GetValue());
+}
+
+bool TableReader::IsIndexed() const {
+    return indexed_;
+}
+
+const std::vector<TableIndexEntry>& TableReader::GetIndex() const {
+    return index_;
+}
+
+std::optional<uint64_t> TableReader::GetRowCount() const {
+    if (!indexed_) {
+        return std::nullopt;
+    }
+    return row_count_;
+}
+
+std::optional<TableSlice> TableReader::GetRowsSlice() const {
+    if (!mapped_file_.IsOpen()) {
+        return std::nullopt;
+    }
+    return TableSlice{file_path_, rows_begin_, std::min<uint64_t>(rows_end_, mapped_file_.GetData().size())};
+}
+
+bool TableReader::Seek(std::string_view key) {
+    auto entry = std::lower_bound(index_.begin(), index_.end(), key,
+                                  [](const TableIndexEntry& entry, std::string_view key) {
+                                      return entry.key < key;
+                                  });
+    Reposition(entry == index_.begin() ? rows_begin_ : std::prev(entry)->offset);
+    while (!Empty() && GetKeyView() < key) {
+        Next();
+    }
+    return !Empty();
+}
+
+bool TableReader::SeekRange(std::string_view first, std::string_view last) {
+    upper_bound_ = std::string(last);
+    return Seek(first);
+}
+
+void TableReader::SetUpperBound(std::string key) {
+    upper_bound_ = std::move(key);
+    if (!empty_ && key_view_ >= upper_bound_.value()) {
+        empty_ = true;
+    }
 }
 
 std::vector<std::pair<std::string, std::string>> TableReader::ReadAllItems() {
@@ -52,16 +604,76 @@ std::vector<std::pair<std::string, std::string>> TableReader::ReadAllItems() {
     return result;
 }
 
-TableWriter::TableWriter(const std::string& table_path)
-    : table_stream_(table_path) {
+TableWriter::TableWriter(const std::string& table_path, TableFormat format, size_t buffer_size)
+    : TableWriter(CreateTableFile(table_path), format, buffer_size) {
 }
 
-void TableWriter::Write(const std::string& key, const std::string& value) {
-    table_stream_ << key << "\t" << value << "\n";
+TableWriter::TableWriter(int fd, TableFormat format, size_t buffer_size)
+    : fd_(fd),
+      format_(format),
+      buffer_(std::max<size_t>(buffer_size, binary_table_magic.size())) {
+    if (fd_ < 0) {
+        throw std::runtime_error(std::string("Can't open table: ") + std::strerror(errno));
+    }
+    if (format_ == TableFormat::Binary) {
+        Put(binary_table_magic);
+    } else if (format_ == TableFormat::CompressedBinary) {
+        Put(compressed_table_magic);
+    }
 }
 
-void TableWriter::Write(const std::string& row) {
-    table_stream_ << row << '\n';
+// Writers that finish close explicitly, so that a failed last flush fails
+// their task; this only cleans up after an exception.
+TableWriter::~TableWriter() {
+    try {
+        Close();
+    } catch (...) {
+    }
+}
+
+void TableWriter::Write(std::string_view key, std::string_view value) {
+    if (index_interval_ > 0) {
+        bool interval_passed = index_.empty() || rows_written_ - index_.back().row >= index_interval_;
+        if (interval_passed && (format_ != TableFormat::CompressedBinary || block_.empty())) {
+            index_.push_back({std::string(key), bytes_written_ + buffer_used_, rows_written_});
+        }
+        ++rows_written_;
+    }
+    char prefix[2 * max_varint_size];
+    std::string_view head, separator = "\t", tail = "\n";
+    if (format_ != TableFormat::Text) {
+        head = {prefix, static_cast<size_t>(EncodeVarint(EncodeVarint(prefix, key.size()), value.size()) - prefix)};
+        separator = tail = {};
+    }
+    if (format_ == TableFormat::CompressedBinary) {
+        block_.append(head).append(key).append(value);
+        if (block_.size() >= compressed_block_size) {
+            FlushBlock();
+        }
+        return;
+    }
+    size_t size = head.size() + key.size() + separator.size() + value.size() + tail.size();
+    if (buffer_used_ + size > buffer_.size()) {
+        if (size > buffer_.size()) {
+            WriteAll({{buffer_.data(), buffer_used_}, head, key, separator, value, tail});
+            buffer_used_ = 0;
+            return;
+        }
+        Flush();
+    }
+    char* out = buffer_.data() + buffer_used_;
+    out = Copy(Copy(Copy(Copy(Copy(out, head), key), separator), value), tail);
+    buffer_used_ = out - buffer_.data();
+}
+
+void TableWriter::Write(std::string_view row) {
+    if (format_ != TableFormat::Text) {
+        size_t tab = row.find('\t');
+        Write(row.substr(0, tab), tab == std::string_view::npos ? std::string_view() : row.substr(tab + 1));
+        return;
+    }
+    Put(row);
+    Put("\n");
 }
 
 void TableWriter::Write(const std::pair<std::string, std::string>& item) {
@@ -74,17 +686,161 @@ void TableWriter::Write(const std::vector<TableItem>& items) {
     }
 }
 
-bool TableWriter::WriteKeyBlock(TableReader& reader) {
-    if (reader.Empty()) {
-        return false;
+TableFormat TableWriter::GetFormat() const {
+    return format_;
+}
+
+void TableWriter::EnableIndex(size_t interval) {
+    if (format_ == TableFormat::Text) {
+        throw std::runtime_error("Text tables can't be indexed");
     }
-    Write(reader.GetRow());
-    std::string key = reader.GetKey();
-    while (reader.Next() && reader.GetKey() == key) {
-        Write(reader.GetRow());
+    if (bytes_written_ > 0 || buffer_used_ != binary_table_magic.size() || !block_.empty()) {
+        throw std::runtime_error("Table index must be enabled before writing rows");
     }
+    index_interval_ = std::max<size_t>(interval, 1);
+    buffer_[table_flags_position] |= indexed_table_flag;
+}
 
-    return true;
+void TableWriter::WriteRaw(std::string_view rows) {
+    if (rows.empty()) {
+        return;
+    }
+    if (index_interval_ > 0) {
+        size_t position = 0;
+        while (position < rows.size()) {
+            size_t key_size = DecodeVarint(rows, position);
+            size_t value_size = DecodeVarint(rows, position);
+            Write(rows.substr(position, key_size), rows.substr(position + key_size, value_size));
+            position += key_size + value_size;
+        }
+        return;
+    }
+    if (format_ == TableFormat::CompressedBinary) {
+        // Cut the rows into blocks at row boundaries.
+        size_t position = 0;
+        while (position < rows.size()) {
+            size_t begin = position;
+            while (position < rows.size() && block_.size() + position - begin < compressed_block_size) {
+                size_t key_size = DecodeVarint(rows, position);
+                position += key_size + DecodeVarint(rows, position);
+            }
+            block_.append(rows.substr(begin, position - begin));
+            if (block_.size() >= compressed_block_size) {
+                FlushBlock();
+            }
+        }
+        return;
+    }
+    Put(rows);
+    if (format_ == TableFormat::Text && rows.back() != '\n') {
+        Put("\n");
+    }
+}
+
+void TableWriter::Flush() {
+    if (!block_.empty()) {
+        FlushBlock();
+    }
+    if (buffer_used_ > 0) {
+        WriteAll({{buffer_.data(), buffer_used_}});
+        buffer_used_ = 0;
+    }
+}
+
+void TableWriter::Close() {
+    if (fd_ < 0) {
+        return;
+    }
+    try {
+        if (!block_.empty()) {
+            FlushBlock();
+        }
+        if (index_interval_ > 0) {
+            WriteIndex();
+        }
+        Flush();
+    } catch (...) {
+        close(std::exchange(fd_, -1));
+        throw;
+    }
+    if (close(std::exchange(fd_, -1)) != 0) {
+        throw std::runtime_error(std::string("Table close failed: ") + std::strerror(errno));
+    }
+}
+
+void TableWriter::WriteIndex() {
+    uint64_t footer_offset = bytes_written_ + buffer_used_;
+    std::string footer;
+    char varint[max_varint_size];
+    auto put_varint = [&footer, &varint](uint64_t value) {
+        footer.append(varint, EncodeVarint(varint, value) - varint);
+    };
+    put_varint(index_.size());
+    put_varint(rows_written_);
+    for (const auto& entry : index_) {
+        put_varint(entry.row);
+        put_varint(entry.offset);
+        put_varint(entry.key.size());
+        footer.append(entry.key);
+    }
+    for (int i = 0; i < 8; ++i) {
+        footer.push_back(static_cast<char>(footer_offset >> (8 * i)));
+    }
+    footer.append(table_footer_magic);
+    Put(footer);
+}
+
+void TableWriter::FlushBlock() {
+    CompressBlock(block_, stored_block_);
+    char prefix[2 * max_varint_size];
+    char* prefix_end = EncodeVarint(EncodeVarint(prefix, block_.size()), stored_block_.size());
+    GetCompressionStats().raw_bytes += block_.size();
+    GetCompressionStats().stored_bytes += stored_block_.size();
+    // Put may flush a full buffer, and Flush must not see this block again.
+    block_.clear();
+    Put({prefix, static_cast<size_t>(prefix_end - prefix)});
+    Put(stored_block_);
+}
+
+void TableWriter::Put(std::string_view data) {
+    if (buffer_used_ + data.size() > buffer_.size()) {
+        if (data.size() > buffer_.size()) {
+            WriteAll({{buffer_.data(), buffer_used_}, data});
+            buffer_used_ = 0;
+            return;
+        }
+        Flush();
+    }
+    std::memcpy(buffer_.data() + buffer_used_, data.data(), data.size());
+    buffer_used_ += data.size();
+}
+
+void TableWriter::WriteAll(std::initializer_list<std::string_view> pieces) {
+    std::vector<iovec> chunks;
+    for (const auto& piece : pieces) {
+        if (!piece.empty()) {
+            chunks.push_back({const_cast<char*>(piece.data()), piece.size()});
+        }
+    }
+    size_t next = 0;
+    while (next < chunks.size()) {
+        ssize_t written = writev(fd_, chunks.data() + next, std::min<size_t>(chunks.size() - next, IOV_MAX));
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("Table write failed: ") + std::strerror(errno));
+        }
+        bytes_written_ += written;
+        while (next < chunks.size() && static_cast<size_t>(written) >= chunks[next].iov_len) {
+            written -= chunks[next].iov_len;
+            ++next;
+        }
+        if (next < chunks.size()) {
+            chunks[next].iov_base = static_cast<char*>(chunks[next].iov_base) + written;
+            chunks[next].iov_len -= written;
+        }
+    }
 }
 
 void TableWriter::Append(TableReader& reader, size_t max_count) {
@@ -92,8 +848,17 @@ void TableWriter::Append(TableReader& reader, size_t max_count) {
         return;
     }
     size_t count = 0;
+    if (reader.IsMapped() && RowEncoding(reader.GetFormat()) == RowEncoding(format_)) {
+        std::string_view first = reader.GetRawRow();
+        std::string_view last = first;
+        while (reader.Next() && ++count < max_count) {
+            last = reader.GetRawRow();
+        }
+        WriteRaw({first.data(), static_cast<size_t>(last.data() + last.size() - first.data())});
+        return;
+    }
     do {
-        Write(reader.GetRow());
+        Write(reader.GetKeyView(), reader.GetValueView());
     } while (reader.Next() && ++count < max_count);
 }
 
@@ -101,3 +866,48 @@ void TableWriter::Append(const std::string& source_path, size_t max_count) {
     TableReader reader(source_path);
     Append(reader, max_count);
 }
+
+void TableWriter::AppendTable(const std::string& table_path) {
+    TableReader reader(table_path);
+    auto rows = reader.GetRowsSlice();
+    bool whole_table = !ParseTableSlice(table_path).has_value();
+    if (!rows.has_value() || reader.GetFormat() != format_ ||
+        (index_interval_ > 0 && !(whole_table && reader.IsIndexed()))) {
+        Append(reader);
+        return;
+    }
+    // Compressed blocks of the table have to start a block of their own.
+    if (!block_.empty()) {
+        FlushBlock();
+    }
+    if (index_interval_ > 0) {
+        uint64_t rows_offset = bytes_written_ + buffer_used_;
+        for (const auto& entry : reader.GetIndex()) {
+            index_.push_back({entry.key, rows_offset + entry.offset - rows->begin, rows_written_ + entry.row});
+        }
+        rows_written_ += reader.GetRowCount().value();
+    }
+    if (rows->begin == rows->end) {
+        return;
+    }
+    Flush();
+    int input_fd = open(rows->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (input_fd < 0) {
+        throw std::runtime_error("Can't open table " + rows->path);
+    }
+    char last = '\n';
+    try {
+        CopyFileRange(input_fd, rows->begin, rows->end - rows->begin, fd_);
+        if (format_ == TableFormat::Text && pread(input_fd, &last, 1, rows->end - 1) != 1) {
+            throw std::runtime_error("Can't read table " + rows->path);
+        }
+    } catch (...) {
+        close(input_fd);
+        throw;
+    }
+    close(input_fd);
+    bytes_written_ += rows->end - rows->begin;
+    if (last != '\n') {
+        Put("\n");
+    }
+}
@@ -1,13 +1,119 @@
 #pragma once
+#include <atomic>
+#include <cstdint>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <fstream>
 #include <vector>
 
 using TableItem = std::pair<std::string, std::string>;
 
+class MappedFile {
+public:
+    MappedFile() = default;
+
+    MappedFile(const MappedFile&) = delete;
+
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile();
+
+    // Returns false if the path is not a regular file that can be mapped.
+    bool Open(const std::string& path);
+
+    bool IsOpen() const;
+
+    std::string_view GetData() const;
+
+private:
+    bool open_ = false;
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Binary tables start with binary_table_magic followed by rows encoded as
+// varint(key size), varint(value size), key bytes, value bytes. They are
+// used for intermediate results; keys and values may contain any bytes.
+// Compressed tables hold the same rows split into independently zlib
+// compressed blocks of about 64 KiB, each framed as varint(raw size),
+// varint(stored size), stored bytes; equal sizes mean a stored raw block.
+// Sorted binary tables may be indexed: the indexed flag is set in the header
+// and the rows are followed by a sparse index footer (see TableIndexEntry).
+enum class TableFormat {
+    Text,
+    Binary,
+    CompressedBinary
+};
+
+namespace {
+const std::string_view binary_table_magic("\0MRTBL\1\n", 8);
+const std::string_view compressed_table_magic("\0MRTBZ\1\n", 8);
+const size_t table_flags_position = 6;
+const char indexed_table_flag = 2;
+
+const size_t default_index_interval = 1024;
+}
+
+// The footer holds varint(entry count), varint(row count) and for every entry
+// varint(row), varint(offset), varint(key size), key bytes, followed by the
+// fixed 8 byte little endian footer offset and table_footer_magic. Entries are
+// taken every index interval rows; in compressed tables only at block starts,
+// so offsets always point at a row or a block that can be read from.
+struct TableIndexEntry {
+    std::string key;
+    uint64_t offset;
+    uint64_t row;
+};
+
+namespace {
+const std::string_view table_footer_magic("\0MRTIDX\n", 8);
+}
+
+TableFormat DetectTableFormat(const std::string& table_path);
+
+// A byte range [begin, end) of an uncompressed table file aligned to row
+// boundaries. Stages pass slices as "slice:<begin>:<end>:<path>" strings
+// wherever a table path is expected, e.g. instead of copied split chunks.
+struct TableSlice {
+    std::string path;
+    uint64_t begin;
+    uint64_t end;
+};
+
+std::string FormatTableSlice(const TableSlice& slice);
+
+std::optional<TableSlice> ParseTableSlice(const std::string& table_path);
+
+// File holding the rows of a table path or a table slice.
+std::string GetTableFile(const std::string& table_path);
+
+// Copies size bytes at the offset of the input file to the current position
+// of the output descriptor without passing them through user space: as a
+// reflink where the file system and the block alignment allow it, with
+// copy_file_range otherwise, falling back to plain reads and writes.
+void CopyFileRange(int input_fd, uint64_t offset, uint64_t size, int output_fd);
+
+struct CompressionStats {
+    std::atomic<uint64_t> raw_bytes{0};
+    std::atomic<uint64_t> stored_bytes{0};
+};
+
+// Totals over all compressed blocks written by this process.
+CompressionStats& GetCompressionStats();
+
+enum class ReadMode {
+    Stream,
+    Mmap
+};
+
+// In Mmap mode keys and values are views into the mapping and stay valid
+// while the reader is alive; in Stream mode and for compressed tables they
+// are invalidated by Next(). Mmap mode falls back to Stream for pipes and
+// other non-regular files.
 class TableReader {
 public:
-    explicit TableReader(const std::string& table_path);
+    explicit TableReader(const std::string& table_path, ReadMode mode = ReadMode::Mmap);
 
     bool Next();
 
@@ -15,9 +121,26 @@ public:
 
     bool Empty();
 
-    const std::string& GetKey() const;
+    std::string_view GetKeyView() const;
+
+    std::string_view GetValueView() const;
+
+    // True if rows are stable views into an uncompressed mapping.
+    bool IsMapped() const;
+
+    TableFormat GetFormat() const;
+
+    // Encoded bytes of the current row (with its newline for text tables);
+    // only available in Mmap mode and for compressed tables.
+    std::string_view GetRawRow() const;
+
+    // File offset of the current row, or of the end of rows once the reader
+    // is exhausted; only available if IsMapped().
+    uint64_t GetRowOffset() const;
 
-    const std::string& GetValue() const;
+    std::string GetKey() const;
+
+    std::string GetValue() const;
 
     std::string GetRow() const;
 
@@ -25,31 +148,145 @@ public:
 
     std::vector<TableItem> ReadAllItems();
 
+    bool IsIndexed() const;
+
+    const std::vector<TableIndexEntry>& GetIndex() const;
+
+    // Number of rows recorded in the index footer.
+    std::optional<uint64_t> GetRowCount() const;
+
+    // Byte range of the rows in the table file, with compressed blocks as
+    // stored; only available in Mmap mode.
+    std::optional<TableSlice> GetRowsSlice() const;
+
+    // Moves to the first row with a key not less than the given one. Uses the
+    // sparse index when the table has one and scans from the start otherwise.
+    bool Seek(std::string_view key);
+
+    // Restricts iteration to keys in [first, last) and moves to the first of them.
+    bool SeekRange(std::string_view first, std::string_view last);
+
+    // Makes the reader stop before the first key not less than the given one.
+    void SetUpperBound(std::string key);
+
 private:
     bool empty_ = false;
+    std::string file_path_;
+    TableFormat format_ = TableFormat::Text;
+    bool indexed_ = false;
+    std::vector<TableIndexEntry> index_;
+    uint64_t row_count_ = 0;
+    uint64_t rows_begin_ = 0;
+    uint64_t rows_end_ = -1;
+    std::optional<std::string> upper_bound_;
+    std::string_view key_view_;
+    std::string_view value_view_;
+    std::string_view raw_row_view_;
+
+    MappedFile mapped_file_;
+    std::string_view data_;
+    size_t position_ = 0;
+    size_t file_position_ = 0;
+    std::string block_;
+    std::string stored_block_;
+
     std::string key_;
     std::string value_;
     std::ifstream table_stream_;
+
+    bool NextMapped();
+
+    bool NextBinary();
+
+    bool NextStream();
+
+    bool NextStreamBinary();
+
+    bool ReadRow();
+
+    void ReadHeader(std::string_view header, const std::string& table_path);
+
+    void ReadFooter(std::string_view footer);
+
+    void LoadBlock();
+
+    void Reposition(uint64_t offset);
 };
 
+namespace {
+const size_t default_write_buffer_size = 1 << 20;
+}
+
+// Rows are copied into an owned buffer and flushed with plain write/writev
+// calls; pieces larger than the buffer bypass it.
 class TableWriter {
 public:
-    explicit TableWriter(const std::string& table_path);
+    explicit TableWriter(const std::string& table_path,
+                         TableFormat format = TableFormat::Text,
+                         size_t buffer_size = default_write_buffer_size);
+
+    // Takes ownership of an already open descriptor, e.g. a pipe.
+    explicit TableWriter(int fd,
+                         TableFormat format = TableFormat::Text,
+                         size_t buffer_size = default_write_buffer_size);
+
+    TableWriter(const TableWriter&) = delete;
+
+    TableWriter& operator=(const TableWriter&) = delete;
 
-    void Write(const std::string& key, const std::string& value);
+    ~TableWriter();
 
-    void Write(const std::string& row);
+    void Write(std::string_view key, std::string_view value);
+
+    void Write(std::string_view row);
 
     void Write(const TableItem & item);
 
     void Write(const std::vector<TableItem>& items);
 
-    bool WriteKeyBlock(TableReader& reader);
+    TableFormat GetFormat() const;
+
+    // Makes the writer record a sparse index footer; the rows written must be
+    // sorted by key. Has to be called before the first row.
+    void EnableIndex(size_t interval = default_index_interval);
+
+    // Copies rows already encoded in the writer's format as is, adding a final
+    // newline to text rows if it is missing.
+    void WriteRaw(std::string_view rows);
+
+    void Flush();
+
+    // Flushes the rows, writes the index footer if enabled and closes the file.
+    void Close();
 
     void Append(TableReader& reader, size_t max_count = -1);
 
     void Append(const std::string& source_path, size_t max_conut = -1);
 
+    // Copies the rows of a table or slice of the writer's format as bytes,
+    // adding a final newline to text rows if it is missing, and shifts the
+    // index of a whole table behind the rows written so far. Other tables
+    // are appended row by row.
+    void AppendTable(const std::string& table_path);
+
 private:
-    std::ofstream table_stream_;
-};
\ No newline at end of file
+    int fd_ = -1;
+    const TableFormat format_;
+    std::vector<char> buffer_;
+    size_t buffer_used_ = 0;
+    uint64_t bytes_written_ = 0;
+    std::string block_;
+    std::string stored_block_;
+
+    size_t index_interval_ = 0;
+    uint64_t rows_written_ = 0;
+    std::vector<TableIndexEntry> index_;
+
+    void FlushBlock();
+
+    void WriteIndex();
+
+    void Put(std::string_view data);
+
+    void WriteAll(std::initializer_list<std::string_view> pieces);
+};
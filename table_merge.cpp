@@ -0,0 +1,53 @@
+#include "table_merge.h"
+#include <stdexcept>
+
+MergingReader::MergingReader(std::vector<std::unique_ptr<TableReader>> readers)
+    : readers_(std::move(readers)),
+      tree_(readers_.size()) {
+    if (readers_.empty()) {
+        throw std::runtime_error("Nothing to merge");
+    }
+    tree_[0] = Build(1);
+}
+
+bool MergingReader::Empty() const {
+    return readers_[tree_[0]]->Empty();
+}
+
+void MergingReader::Next() {
+    size_t winner = tree_[0];
+    readers_[winner]->Next();
+    for (size_t node = (winner + readers_.size()) / 2; node > 0; node /= 2) {
+        if (Beats(tree_[node], winner)) {
+            std::swap(tree_[node], winner);
+        }
+    }
+    tree_[0] = winner;
+}
+
+TableReader& MergingReader::Current() {
+    return *readers_[tree_[0]];
+}
+
+bool MergingReader::Beats(size_t first, size_t second) const {
+    if (readers_[first]->Empty() || readers_[second]->Empty()) {
+        return !readers_[first]->Empty() || (readers_[second]->Empty() && first < second);
+    }
+    int order = readers_[first]->GetKeyView().compare(readers_[second]->GetKeyView());
+    return order < 0 || (order == 0 && first < second);
+}
+
+// Leaves are the nodes [k, 2k) of an implicit binary heap.
+size_t MergingReader::Build(size_t node) {
+    if (node >= readers_.size()) {
+        return node - readers_.size();
+    }
+    size_t left = Build(2 * node);
+    size_t right = Build(2 * node + 1);
+    if (Beats(left, right)) {
+        tree_[node] = right;
+        return left;
+    }
+    tree_[node] = left;
+    return right;
+}
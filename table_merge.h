@@ -0,0 +1,27 @@
+#pragma once
+#include "table_io.h"
+#include <memory>
+#include <vector>
+
+// Merges tables sorted by key through a loser tree, so every row costs
+// about log2(k) key comparisons. Equal keys come from earlier readers first.
+class MergingReader {
+public:
+    explicit MergingReader(std::vector<std::unique_ptr<TableReader>> readers);
+
+    bool Empty() const;
+
+    void Next();
+
+    // Reader holding the smallest current row.
+    TableReader& Current();
+
+private:
+    std::vector<std::unique_ptr<TableReader>> readers_;
+    // tree_[0] is the winner, tree_[1..k) hold the losers of inner matches.
+    std::vector<size_t> tree_;
+
+    bool Beats(size_t first, size_t second) const;
+
+    size_t Build(size_t node);
+};
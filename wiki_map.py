@@ -1,27 +1,18 @@
 from wiki import WikipediaParser
+from chunks import read_chunks
 from typing import Set, List, Dict
 from threading import Thread
 from queue import Queue
 from argparse import ArgumentParser
-from sys import stdin
 
 
 def get_content(url: str, contents: 'Queue[str]') -> None:
     contents.put((url, WikipediaParser.get_content(url)))
 
 
-if __name__ == "__main__":
-    parser = ArgumentParser()
-    parser.add_argument('-w', '--words', default='words.txt', type=str, dest='words')
-    args = parser.parse_args()
-
+def map_chunk(urls: List[str], words: List[str]) -> None:
     contents: 'Queue[str]' = Queue()
-    urls = [row.split('\t')[0] for row in stdin]
-
-    dictionary: Dict[str, Set[str]] = dict()
-    with open(args.words, 'r') as words:
-        for key, value in [row.split('\t') for row in words]:
-            dictionary[key] = set()
+    dictionary: Dict[str, Set[str]] = {word: set() for word in words}
 
     while urls:
         threads = []
@@ -46,3 +37,15 @@ if __name__ == "__main__":
     for key, value in dictionary.items():
         print(f'{key}\t{" ".join(value)}')
 
+
+if __name__ == "__main__":
+    parser = ArgumentParser()
+    parser.add_argument('-w', '--words', default='words.txt', type=str, dest='words')
+    args = parser.parse_args()
+
+    with open(args.words, 'r') as words:
+        keys = [row.split('\t')[0] for row in words]
+
+    for rows in read_chunks():
+        map_chunk([row.split('\t')[0] for row in rows], keys)
+
@@ -0,0 +1,264 @@
+#include "worker_pool.h"
+#include "table_io.h"
+#include <boost/process.hpp>
+#include <cerrno>
+#include <chrono>
+#include <fcntl.h>
+#include <fstream>
+#include <optional>
+#include <poll.h>
+#include <signal.h>
+#include <thread>
+#include <unistd.h>
+
+namespace bp = boost::process;
+
+namespace {
+using Deadline = std::optional<std::chrono::steady_clock::time_point>;
+
+// Waits for output until the deadline; false if there is none by then.
+bool WaitOutput(int fd, const Deadline& deadline) {
+    while (deadline.has_value()) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline.value() - std::chrono::steady_clock::now()).count();
+        pollfd output{fd, POLLIN, 0};
+        int ready = poll(&output, 1, std::max<int64_t>(left, 0));
+        if (ready > 0) {
+            return true;
+        }
+        if (ready == 0 || errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Copies the worker output up to the end of chunk marker into the result, or
+// drops it without one; returns false if the worker exits or passes the
+// deadline before printing the marker.
+bool ReadChunkOutput(int fd, std::ostream* result, const Deadline& deadline = std::nullopt) {
+    // Pending bytes always start at a line start, so the marker is either
+    // at their beginning or right after a newline.
+    std::string marker_line = std::string(chunk_end_marker) + "\n";
+    std::string pending;
+    std::vector<char> buffer(1 << 16);
+    while (true) {
+        if (!WaitOutput(fd, deadline)) {
+            return false;
+        }
+        ssize_t size = read(fd, buffer.data(), buffer.size());
+        if (size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
+            return false;
+        }
+        pending.append(buffer.data(), size);
+        size_t marker = pending.compare(0, marker_line.size(), marker_line) == 0
+                        ? 0 : pending.find("\n" + marker_line);
+        if (marker != std::string::npos) {
+            size_t rows_end = marker == 0 ? 0 : marker + 1;
+            if (result == nullptr) {
+                return true;
+            }
+            result->write(pending.data(), rows_end);
+            return static_cast<bool>(result->flush());
+        }
+        size_t lines_end = pending.rfind('\n');
+        if (lines_end != std::string::npos) {
+            if (result != nullptr) {
+                result->write(pending.data(), lines_end + 1);
+            }
+            pending.erase(0, lines_end + 1);
+        }
+    }
+}
+}
+
+struct WorkerPool::Worker {
+    bp::child process;
+    int input_fd = -1;
+    int output_fd = -1;
+
+    // Closing the input lets a healthy script finish and exit.
+    ~Worker() {
+        close(input_fd);
+        close(output_fd);
+        std::error_code error;
+        if (process.valid()) {
+            process.wait(error);
+        }
+    }
+
+    void Kill() {
+        std::error_code error;
+        process.terminate(error);
+    }
+};
+
+WorkerPool::WorkerPool() : max_workers_(std::max(std::thread::hardware_concurrency(), 1u)) {
+}
+
+WorkerPool::~WorkerPool() {
+    Shutdown();
+}
+
+void WorkerPool::Perform(const std::string& script_command,
+                         const std::string& source_path,
+                         const std::string& result_path) {
+    ++stats_.chunks;
+    auto worker = Acquire(script_command);
+    if (Feed(*worker, source_path, result_path)) {
+        Release(script_command, std::move(worker));
+        return;
+    }
+    // The replacement takes the place of the killed worker.
+    worker->Kill();
+    worker.reset();
+    ++stats_.restarts;
+    try {
+        worker = Spawn(script_command);
+    } catch (...) {
+        Discard(script_command);
+        throw;
+    }
+    if (!Feed(*worker, source_path, result_path)) {
+        worker->Kill();
+        worker.reset();
+        Discard(script_command);
+        throw std::runtime_error("Worker " + script_command + " failed on " + source_path +
+                                 " or didn't finish it within " +
+                                 std::to_string(std::chrono::seconds(worker_chunk_timeout).count()) + " s");
+    }
+    Release(script_command, std::move(worker));
+}
+
+void WorkerPool::SetMaxWorkers(size_t max_workers) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_workers_ = std::max<size_t>(max_workers, 1);
+}
+
+void WorkerPool::Shutdown() {
+    std::multimap<std::string, std::unique_ptr<Worker>> workers;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        workers.swap(idle_workers_);
+        for (const auto& [script_command, worker] : workers) {
+            --workers_[script_command];
+        }
+    }
+}
+
+const WorkerStats& WorkerPool::GetStats() const {
+    return stats_;
+}
+
+std::unique_ptr<WorkerPool::Worker> WorkerPool::Acquire(const std::string& script_command) {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto idle = idle_workers_.end();
+        released_cv_.wait(lock, [&] {
+            idle = idle_workers_.find(script_command);
+            return idle != idle_workers_.end() || workers_[script_command] < max_workers_;
+        });
+        if (idle != idle_workers_.end()) {
+            auto worker = std::move(idle->second);
+            idle_workers_.erase(idle);
+            return worker;
+        }
+        ++workers_[script_command];
+    }
+    try {
+        return Spawn(script_command);
+    } catch (...) {
+        Discard(script_command);
+        throw;
+    }
+}
+
+std::unique_ptr<WorkerPool::Worker> WorkerPool::Spawn(const std::string& script_command) {
+    int input[2];
+    int output[2];
+    if (pipe2(input, O_CLOEXEC) != 0) {
+        throw std::runtime_error("Can't create pipe for " + script_command);
+    }
+    if (pipe2(output, O_CLOEXEC) != 0) {
+        close(input[0]);
+        close(input[1]);
+        throw std::runtime_error("Can't create pipe for " + script_command);
+    }
+    bp::pipe worker_input(input[0], input[1]);
+    bp::pipe worker_output(output[0], output[1]);
+
+    auto worker = std::make_unique<Worker>();
+    auto start = std::chrono::steady_clock::now();
+    worker->process = bp::child(script_command, bp::std_in < worker_input, bp::std_out > worker_output,
+                                bp::env["MAPREDUCE_PERSISTENT"] = "1");
+    worker->input_fd = fcntl(input[1], F_DUPFD_CLOEXEC, 0);
+    worker->output_fd = fcntl(output[0], F_DUPFD_CLOEXEC, 0);
+
+    // The handshake is an empty chunk; a script that doesn't speak the
+    // protocol never echoes its end, since its input stays open.
+    std::string marker_line = std::string(chunk_end_marker) + "\n";
+    bool answered = write(worker->input_fd, marker_line.data(), marker_line.size()) ==
+                        static_cast<ssize_t>(marker_line.size()) &&
+                    ReadChunkOutput(worker->output_fd, nullptr, start + worker_handshake_timeout);
+    if (!answered) {
+        worker->Kill();
+        throw std::runtime_error("Worker " + script_command + " didn't answer an empty chunk within " +
+                                 std::to_string(worker_handshake_timeout.count()) +
+                                 " s; persistent workers need scripts that echo the chunk end marker");
+    }
+    stats_.spawn_nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    ++stats_.spawns;
+    return worker;
+}
+
+void WorkerPool::Release(const std::string& script_command, std::unique_ptr<Worker> worker) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_workers_.emplace(script_command, std::move(worker));
+    released_cv_.notify_all();
+}
+
+void WorkerPool::Discard(const std::string& script_command) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    --workers_[script_command];
+    released_cv_.notify_all();
+}
+
+// The output is read by a separate thread, so a worker blocked on printing
+// can't stall the input. A failed input kills the worker, which ends the
+// output with an EOF. A worker past the deadline is killed by the reader,
+// which fails the input of a worker that stopped reading it.
+bool WorkerPool::Feed(Worker& worker, const std::string& source_path, const std::string& result_path) {
+    auto deadline = std::chrono::steady_clock::now() + worker_chunk_timeout;
+    bool output_complete = false;
+    std::thread output_reader([&] {
+        std::ofstream result(result_path, std::ios::binary);
+        output_complete = ReadChunkOutput(worker.output_fd, &result, deadline);
+        if (!output_complete) {
+            // The worker is only reaped by Kill, so its pid can't be reused yet.
+            kill(worker.process.id(), SIGKILL);
+        }
+    });
+    bool input_complete = true;
+    try {
+        TableReader source(source_path);
+        // The writer closes its duplicate, the worker input stays open.
+        TableWriter input(fcntl(worker.input_fd, F_DUPFD_CLOEXEC, 0));
+        input.Append(source);
+        input.Write(chunk_end_marker);
+        input.Close();
+    } catch (const std::exception&) {
+        input_complete = false;
+        worker.Kill();
+    }
+    output_reader.join();
+    return input_complete && output_complete;
+}
+
+WorkerPool& GetWorkerPool() {
+    static WorkerPool pool;
+    return pool;
+}
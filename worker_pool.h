@@ -0,0 +1,87 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+// Persistent workers run with MAPREDUCE_PERSISTENT=1 in their environment and
+// read any number of chunks from stdin. Every chunk ends with a line holding
+// only chunk_end_marker; the script has to print the same line and flush its
+// output once it is done with the chunk, and must not print anything else
+// until the next chunk arrives. A new worker is first fed an empty chunk and
+// has to answer it within worker_handshake_timeout, so a script that doesn't
+// follow the protocol fails the job instead of hanging it. A worker that
+// doesn't finish a chunk within worker_chunk_timeout is killed like one that
+// died on it.
+namespace {
+const std::string_view chunk_end_marker("\x1e");
+const std::chrono::seconds worker_handshake_timeout(30);
+const std::chrono::minutes worker_chunk_timeout(10);
+}
+
+struct WorkerStats {
+    std::atomic<uint64_t> chunks{0};
+    std::atomic<uint64_t> spawns{0};
+    std::atomic<uint64_t> restarts{0};
+    // Until the handshake is answered, so interpreter startup and imports count.
+    std::atomic<uint64_t> spawn_nanoseconds{0};
+};
+
+// Keeps started scripts alive between chunks, so a job with many chunks pays
+// for process creation once per worker instead of once per chunk.
+class WorkerPool {
+public:
+    WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    ~WorkerPool();
+
+    // Feeds the table to an idle worker of the script, starting one if there
+    // is none and the script has less than max_workers, or else waiting for
+    // one. Writes its output for the table to result_path. A worker that dies
+    // on the way or passes the chunk timeout is replaced and the table is fed
+    // again once.
+    void Perform(const std::string& script_command,
+                 const std::string& source_path,
+                 const std::string& result_path);
+
+    // Caps the workers of every script, busy or idle; one per core by default.
+    void SetMaxWorkers(size_t max_workers);
+
+    // Closes the input of the idle workers and waits for them to exit.
+    void Shutdown();
+
+    const WorkerStats& GetStats() const;
+
+private:
+    struct Worker;
+
+    std::mutex mutex_;
+    std::condition_variable released_cv_;
+    std::multimap<std::string, std::unique_ptr<Worker>> idle_workers_;
+    // Idle, busy and starting workers of every script.
+    std::map<std::string, size_t> workers_;
+    size_t max_workers_;
+    WorkerStats stats_;
+
+    std::unique_ptr<Worker> Acquire(const std::string& script_command);
+
+    std::unique_ptr<Worker> Spawn(const std::string& script_command);
+
+    void Release(const std::string& script_command, std::unique_ptr<Worker> worker);
+
+    // Gives up the place of a killed worker or one that failed to start.
+    void Discard(const std::string& script_command);
+
+    bool Feed(Worker& worker, const std::string& source_path, const std::string& result_path);
+};
+
+WorkerPool& GetWorkerPool();